@@ -6,27 +6,56 @@
 #include <type_traits>
 #include <algorithm>
 #include <fstream>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <iomanip>
 #include <cfloat>
+#include <fcntl.h>
+#include <unistd.h>
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "schedule.h"
+#include "replay.h"
+#include "transposition.h"
+#include "pool.h"
+#include "xoshiro.h"
 
 const int tuple_num = 4;
 const int tuple_length = 6;
 std::vector<std::vector<int>> indices;
+// the cells of tuple i on the k-th symmetric board, at isomorphic[k * tuple_num + i]
+int isomorphic[8 * tuple_num][tuple_length];
 std::vector<weight> net;
 
+// multi-stage network, each stage owns tuple_num * 4 tables starting at net[stage * tuple_num * 4]
+// the stage of a board is the number of bounds reached by its largest tile (or its bonus tile count)
+int stage_count = 1;
+bool stage_by_bonus = false;
+board::cell stage_bound[3] = { -1u, -1u, -1u };
+
+// bumped whenever the weights are trained, cached evaluations of older versions are stale
+std::atomic<uint32_t> net_version(0);
+
 class agent {
 public:
-    agent(const std::string& args = "") {
+    agent(const std::string& args = "") : searchers(1), salt(0), cutoff(0), expect(false), enumerate(false), prune(false),
+        star2(false), bounded(false), vmin(-FLT_MAX), vmax(FLT_MAX), searches(0), timed(false), aborted(false), known(0) {
         std::stringstream ss("name=unknown role=unknown " + args);
         for (std::string pair; ss >> pair; ) {
             std::string key = pair.substr(0, pair.find('='));
             std::string value = pair.substr(pair.find('=') + 1);
             meta[key] = { value };
         }
-        if (meta.find("seed") != meta.end())
-            engine.seed(int(meta["seed"]));
+        if (meta.find("seed") != meta.end()) // pass seed=... for the random streams
+            origin.seed(std::stoull(meta["seed"].value));
+        if (meta.find("lane") != meta.end()) { // pass lane=i for the i-th of several games played at once
+            for (int i = 0; i < int(meta["lane"]); i++) origin.long_jump();
+        }
+        engine = stream(0);
+        searchers[0].engine = stream(2);
 
         if (indices.size() == 0) {
             indices.push_back({0, 4, 8, 12, 9, 13});
@@ -34,12 +63,54 @@ public:
             indices.push_back({1, 5, 9, 2, 6, 10});
             indices.push_back({2, 6, 10, 3, 7, 11});
         }
+        board cells(board::grid({{ { 0, 1, 2, 3 }, { 4, 5, 6, 7 }, { 8, 9, 10, 11 }, { 12, 13, 14, 15 } }}));
+        for (int k = 0; k < 8; k++) {
+            if (k % 2 == 0 && k > 0) cells.rotate_right();
+            for (int i = 0; i < tuple_num; i++) for (int j = 0; j < tuple_length; j++)
+                isomorphic[k * tuple_num + i][j] = cells(indices[i][j]);
+            cells.reflect_vertical();
+        }
+        if (meta.find("stage") != meta.end()) { // pass stage=largest:9,11 or stage=bonus:1,3 for a multi-stage network
+            std::string stage = meta["stage"];
+            stage_by_bonus = stage.find("bonus") == 0;
+            std::stringstream bounds(stage.substr(stage.find(':') + 1));
+            stage_count = 1;
+            for (std::string bound; std::getline(bounds, bound, ',') && stage_count <= 3; )
+                stage_bound[stage_count++ - 1] = std::stoul(bound);
+        }
+        if (meta.find("tt") != meta.end()) // pass tt=20 for a transposition table of 2^20 buckets
+            tt = std::make_shared<transposition>(unsigned(meta["tt"]));
+        if (meta.find("chance") != meta.end()) // pass chance=expect to average the placements instead of taking the worst
+            expect = meta["chance"].value == "expect";
+        if (meta.find("spawns") != meta.end()) // pass spawns=all to search every outcome of a placement instead of guesses
+            enumerate = meta["spawns"].value == "all";
+        if (meta.find("prune") != meta.end()) { // pass prune=1 for alpha-beta windows (and Star1 with chance=expect)
+            prune = int(meta["prune"]) > 0;
+            star2 = int(meta["prune"]) > 1; // or prune=2 for Star2 probing as well
+        }
+        if (meta.find("bounds") != meta.end()) { // pass bounds=L:U, the range of a board value, for Star1/Star2
+            std::string bounds = meta["bounds"];
+            vmin = std::stof(bounds.substr(0, bounds.find(':')));
+            vmax = std::stof(bounds.substr(bounds.find(':') + 1));
+            bounded = true;
+        }
+        if (meta.find("threads") != meta.end() && int(meta["threads"]) > 1) { // pass threads=N to search in parallel
+            workers = std::make_shared<pool>(int(meta["threads"]));
+            for (size_t i = 1; i < workers->size(); i++) searchers.emplace_back(stream(2 + i), i);
+            if (meta.find("cutoff") != meta.end()) // pass cutoff=L to split chance nodes of level L and above into tasks
+                cutoff = int(meta["cutoff"]);
+        }
+        if (meta.find("cache") != meta.end()) { // pass cache=16 for an evaluation cache of 2^16 entries per thread
+            for (searcher& s : searchers) s.cache.assign(size_t(1) << int(meta["cache"]), { 0, -1u, 0 });
+        }
     }
     virtual ~agent() {}
     virtual void open_episode(const std::string& flag = "") {}
     virtual void close_episode(const std::string& flag = "") {}
     virtual action take_action(board& b, action prev) { return action(); }
     virtual bool check_for_win(const board& b) { return false; }
+    virtual void ponder(const board& after, action move) {}
+    virtual void stop_pondering() {}
 
 public:
     virtual std::string property(const std::string& key) const { return meta.at(key); }
@@ -47,21 +118,61 @@ public:
     virtual std::string name() const { return property("name"); }
     virtual std::string role() const { return property("role"); }
 
+    // return the average searched nodes per move and the transposition table usage
+    virtual std::string search_summary() const {
+        size_t nodes = 0, hits = 0, misses = 0;
+        transposition::counters lookups;
+        for (const searcher& s : searchers) {
+            nodes += s.nodes;
+            hits += s.hits;
+            misses += s.misses;
+            lookups += s.lookups;
+        }
+        std::stringstream ss;
+        ss << name() << ": nodes = " << nodes << " (" << (searches ? nodes / searches : 0) << "/move)";
+        if (tt) ss << ", " << lookups;
+        if (hits + misses) ss << ", cache: hits = " << hits << " (" << std::fixed << std::setprecision(1) << (hits * 100.0 / (hits + misses)) << "%)";
+        return ss.str();
+    }
+
 protected:
     virtual void init_weights() {
         if (net.size() > 0) return ;
-        for (int i = 0; i < tuple_num * 4; i++)
+        net.reserve(stage_count * tuple_num * 4);
+        for (int i = 0; i < stage_count * tuple_num * 4; i++)
             net.emplace_back(1 << 24); // create an empty weight table with size 16^6 * 4 hint tile
     }
     virtual void load_weights(const std::string& path) {
         if (net.size() > 0) return ;
-        std::ifstream in(path, std::ios::in | std::ios::binary);
-        if (!in.is_open()) std::exit(-1);
+        if (meta.find("mmap") != meta.end()) { // pass mmap=1 to map the tables and read them in on demand
+            map_weights(path);
+        } else {
+            std::ifstream in(path, std::ios::in | std::ios::binary);
+            if (!in.is_open()) std::exit(-1);
+            uint32_t size;
+            in.read(reinterpret_cast<char*>(&size), sizeof(size));
+            net.resize(size);
+            for (weight& w : net) in >> w;
+            in.close();
+        }
+        // stages that are not in the file start from empty tables
+        while (net.size() < size_t(stage_count * tuple_num * 4)) net.emplace_back(1 << 24);
+    }
+    virtual void map_weights(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) std::exit(-1);
         uint32_t size;
-        in.read(reinterpret_cast<char*>(&size), sizeof(size));
+        if (pread(fd, &size, sizeof(size), 0) != sizeof(size)) std::exit(-1);
         net.resize(size);
-        for (weight& w : net) in >> w;
-        in.close();
+        size_t offset = sizeof(size);
+        for (weight& w : net) {
+            uint64_t len;
+            if (pread(fd, &len, sizeof(len), offset) != sizeof(len)) std::exit(-1);
+            offset += sizeof(len);
+            if (!w.map(fd, offset, len)) std::exit(-1);
+            offset += sizeof(float) * len;
+        }
+        ::close(fd);
     }
     virtual void save_weights(const std::string& path) {
         std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
@@ -72,6 +183,42 @@ protected:
         out.close();
     }
 
+    /**
+     * the k-th random stream of the agent, k jumps of 2^128 draws ahead of the stream of its seed and lane
+     * stream 0 is the engine of the agent, 1 the placements of an environment, and 2 + i the engine of searcher i
+     */
+    xoshiro stream(unsigned k) const {
+        xoshiro s(origin);
+        for (unsigned i = 0; i < k; i++) s.jump();
+        return s;
+    }
+    // the streams to checkpoint with streams=...
+    virtual std::vector<xoshiro*> streams() {
+        std::vector<xoshiro*> all = { &engine };
+        for (searcher& s : searchers) all.push_back(&s.engine);
+        return all;
+    }
+    /**
+     * with streams=path, the streams continue from the file if it exists, and are saved to it when the agent ends,
+     * so a run that continues from saved weights draws the same numbers as one that was never stopped
+     * the file of lane i (i > 0) is path.i
+     */
+    void load_streams() {
+        if (meta.find("streams") == meta.end()) return;
+        std::ifstream in(streams_path());
+        for (xoshiro* s : streams()) in >> *s;
+    }
+    void save_streams() {
+        if (meta.find("streams") == meta.end()) return;
+        std::ofstream out(streams_path(), std::ios::out | std::ios::trunc);
+        for (xoshiro* s : streams()) out << *s << std::endl;
+    }
+    std::string streams_path() {
+        std::string path = meta["streams"];
+        if (meta.find("lane") != meta.end() && int(meta["lane"]) > 0) path += "." + meta["lane"].value;
+        return path;
+    }
+
 protected:
     // return the tuple index in weight table
     int tuple_index(const board& b, int index) {
@@ -85,94 +232,453 @@ protected:
         return result;
     }
 
-    float state_approximation(const board& b) {
-        float value = 0.0;
+    // return the first table of the board, i.e., its stage and hint tile
+    // the stage is counted without branches, bounds of unused stages are never reached
+    static int table_offset(const board& b) {
+        board::cell key = stage_by_bonus ? b.get_bonus_count() : b.get_largest();
+        int stage = (key >= stage_bound[0]) + (key >= stage_bound[1]) + (key >= stage_bound[2]);
         // hint tile index in weight table is 1, 2, 3, 0 for 1-tile, 2-tile, 3-tile, bonus-tile
-        int hint = b.info() > 3 ? 0 : b.info();
-        board tmp(b);
-        for (int k = 0; k < 4; k++) {
-            if (k > 0)  tmp.rotate_right();
-            for (int i = 0; i < tuple_num; i++) value += net[i * 4 + hint][tuple_index(tmp, i)];
-            tmp.reflect_vertical();
-            for (int i = 0; i < tuple_num; i++) value += net[i * 4 + hint][tuple_index(tmp, i)];
-            tmp.reflect_vertical();
+        int hint = hint_of(b) > 3 ? 0 : hint_of(b);
+        return stage * tuple_num * 4 + hint;
+    }
+
+    /**
+     * with spawns=all, the search carries the remaining tile bag in the board info above the hint,
+     * as 4-bit counts of the 1, 2, and 3-tiles, and a zero bag means the bag is unknown
+     */
+    static int hint_of(const board& b) { return b.info() & 0xff; }
+    static int bag_of(const board& b) { return b.info() >> 8; }
+
+    /**
+     * the tuple indices of all 8 symmetries, index[k * tuple_num + i] is tuple i of the k-th symmetry
+     * the symmetric boards are never built, the tuples are read through their isomorphic cells instead
+     */
+    void features(const board& b, int index[]) {
+        for (int j = 0; j < 8 * tuple_num; j++) {
+            int result = 0;
+            for (int i = 0; i < tuple_length; i++) result = (result << 4) | b(isomorphic[j][i]);
+            index[j] = result;
         }
+    }
+
+    float state_approximation(const board& b) {
+        int index[8 * tuple_num];
+        features(b, index);
+        return sum_features(table_offset(b), index);
+    }
+    float sum_features(int offset, const int index[]) {
+        float value = 0.0;
+        for (int j = 0; j < 8 * tuple_num; j++) value += net[offset + (j % tuple_num) * 4][index[j]];
         return value / 8.0;
     }
 
-    // return the worst board value
-    float after_value(const board& after, int last_op, int level) {
-        if (level == 1)
-            return state_approximation(after);
+    /**
+     * the state of one search thread
+     * searchers[0] belongs to the thread that calls take_action, the others to the search pool
+     */
+    struct searcher {
+        xoshiro engine;
+        size_t nodes;
+        size_t id;
+        // direct-mapped evaluation cache, empty if disabled
+        struct cached {
+            board::data tiles;
+            uint32_t tag; // weight version and table offset
+            float value;
+        };
+        std::vector<cached> cache;
+        size_t hits;
+        size_t misses;
+        transposition::counters lookups;
+        searcher(const xoshiro& engine = xoshiro(), size_t id = 0) :
+            engine(engine), nodes(0), id(id), hits(0), misses(0) {}
+    };
+
+    // evaluate a leaf through the searcher's cache
+    float evaluate(searcher& s, const board& b) {
+        float value;
+        evaluate_batch(s, &b, 1, &value);
+        return value;
+    }
+
+    /**
+     * evaluate up to 4 leaves at once: the indices of all leaves missing from the cache are computed
+     * and prefetched first, so their weight lookups overlap instead of stalling one after another
+     */
+    void evaluate_batch(searcher& s, const board b[], int n, float value[]) {
+        int index[4][8 * tuple_num], offset[4], miss[4], m = 0;
+        searcher::cached* slot[4] = {};
+        for (int i = 0; i < n; i++) {
+            offset[m] = table_offset(b[i]);
+            if (s.cache.size()) {
+                board::data tiles = b[i].pack();
+                uint32_t tag = (net_version.load(std::memory_order_relaxed) << 8) | offset[m];
+                uint64_t hash = (tiles ^ (uint64_t(tag) << 40)) * 0x9e3779b97f4a7c15ull;
+                slot[m] = &s.cache[(hash >> 32) & (s.cache.size() - 1)];
+                if (slot[m]->tiles == tiles && slot[m]->tag == tag) {
+                    s.hits++;
+                    value[i] = slot[m]->value;
+                    continue;
+                }
+                s.misses++;
+                slot[m]->tiles = tiles;
+                slot[m]->tag = tag;
+            }
+            features(b[i], index[m]);
+            for (int j = 0; j < 8 * tuple_num; j++) net[offset[m] + (j % tuple_num) * 4].prefetch(index[m][j]);
+            miss[m++] = i;
+        }
+        for (int k = 0; k < m; k++) {
+            value[miss[k]] = sum_features(offset[k], index[k]);
+            if (slot[k]) slot[k]->value = value[miss[k]];
+        }
+    }
 
-        board::cell hint = after.info();       
+    /**
+     * a placement that may follow an after-state, as searched by a chance node
+     * the search applies it to the after-state in place, and takes it back with board::unplace()
+     */
+    struct spawn {
+        unsigned pos;
+        board::cell tile;
+        board::data info; // the next hint
+        bool counted; // whether the tile counters are updated as well
+        board::reward reward;
+        float prob;
+    };
+    static void apply(board& b, const spawn& c) {
+        b.info(c.info);
+        b.place(c.pos, c.tile);
+        if (!c.counted) return;
+        if (hint_of(b) > 3) b.add_bonus_tile();
+        b.add_tile();
+    }
+
+    /**
+     * list the placements searched after the slide last_op, return the number of them
+     * the next tile is a randomly guessed bonus tile with 1/21 probability (if a bonus tile can be placed),
+     * or each of the 1, 2, and 3 hint tiles, and all placements are equally likely
+     *
+     * the guesses are drawn from the position and the salt of the current move,
+     * so a search gives the same result whatever is pruned or which thread gets there first
+     */
+    int expand(searcher& s, const board& after, int last_op, spawn child[]) {
+        if (enumerate) return enumerate_spawns(after, last_op, child);
+        std::default_random_engine draw(uint32_t(transposition::hash(after, last_op, 0) ^ salt));
+        board::cell hint = after.info();
         if (hint > 3) {
             // randomly guess next bonus tile
             std::uniform_int_distribution<int> popup_bonus(4, after.get_largest() - 3);
-            hint = popup_bonus(engine);
+            hint = popup_bonus(draw);
+        }
+
+        int num = 0;
+        std::uniform_int_distribution<int> popup1(0, 20);
+        bool bonus = after.can_place_bonus_tile() && popup1(draw) == 0;
+        for (int t = 1; t <= (bonus ? 1 : 3); t++) for (int pos = 0; pos < 16; pos++) {
+            if ((last_op == 0) && (pos < 12))       continue;
+            if ((last_op == 1) && (pos % 4 != 0))   continue;
+            if ((last_op == 2) && (pos > 3))        continue;
+            if ((last_op == 3) && (pos % 4 != 3))   continue;
+            if (after(pos) != 0) continue;
+
+            child[num++] = { unsigned(pos), hint, board::data(bonus ? 4 : t), false, board::score_of(hint), 0 };
+        }
+        for (int i = 0; i < num; i++) child[i].prob = 1.0f / num;
+        return num;
+    }
+
+    /**
+     * list every outcome of the placement after the slide last_op with its probability, for spawns=all
+     * the placed tile is the hint, or any bonus tile from 6-tile to (Vmax/8)-tile, on any legal position;
+     * the next hint is a bonus tile with 1/21 probability (if a bonus tile can be placed),
+     * otherwise it is drawn from the tile bag, or is 1, 2, or 3-tile alike if the bag is unknown
+     *
+     * nothing is drawn at random, so the search is a pure function of the board
+     */
+    int enumerate_spawns(const board& after, int last_op, spawn child[]) {
+        int pos[4], places = 0;
+        for (int i = 0; i < 16; i++) {
+            if ((last_op == 0) && (i < 12))       continue;
+            if ((last_op == 1) && (i % 4 != 0))   continue;
+            if ((last_op == 2) && (i > 3))        continue;
+            if ((last_op == 3) && (i % 4 != 3))   continue;
+            if (after(i) == 0) pos[places++] = i;
         }
 
-        // randomly pick one hint tile for search
+        board::cell tile[9];
+        int tiles = 0;
+        if (hint_of(after) > 3) {
+            for (board::cell t = 4; t + 3 <= after.get_largest() && tiles < 9; t++) tile[tiles++] = t;
+        }
+        if (tiles == 0) tile[tiles++] = std::min(hint_of(after), 4);
+
+        struct outcome {
+            board::data info;
+            float prob;
+        } next[4];
+        int hints = 0, bag = bag_of(after);
+        int left[3] = { bag & 0xf, (bag >> 4) & 0xf, (bag >> 8) & 0xf };
+        int total = left[0] + left[1] + left[2];
+        float bonus = after.can_place_bonus_tile() ? 1.0f / 21 : 0.0f;
+        for (int t = 1; t <= 3; t++) {
+            if (total && left[t - 1] == 0) continue;
+            int rest = total ? bag - (1 << ((t - 1) * 4)) : 0;
+            if (total == 1) rest = 0x444; // the bag is refilled once it is empty
+            next[hints++] = { board::data(t) | (board::data(rest) << 8), (1 - bonus) * (total ? float(left[t - 1]) / total : 1.0f / 3) };
+        }
+        if (bonus > 0) next[hints++] = { board::data(4) | (board::data(bag) << 8), bonus };
+
+        int num = 0;
+        for (int i = 0; i < places; i++) for (int k = 0; k < tiles; k++) for (int h = 0; h < hints; h++) {
+            child[num++] = { unsigned(pos[i]), tile[k], next[h].info, true, board::score_of(tile[k]), next[h].prob / (places * tiles) };
+        }
+        return num;
+    }
+
+    /**
+     * return the worst board value, or the expected board value with chance=expect
+     * with prune=1, the value is only exact inside the window (alpha, beta), otherwise it is a bound
+     */
+    float after_value(searcher& s, board& after, int last_op, int level, float alpha = -FLT_MAX, float beta = FLT_MAX) {
+        s.nodes++;
+        if (timeout(s)) return 0;
+        if (level <= 1)
+            return evaluate(s, after);
+
+        uint64_t key = 0;
+        transposition::result known;
+        if (tt) {
+            key = transposition::hash(after, last_op, level);
+            if (tt->find(key, known, s.lookups) && usable(known, alpha, beta)) return known.value;
+        }
+
+        spawn child[max_spawns];
+        int num = expand(s, after, last_op, child);
+        float value;
+        int type = transposition::exact;
+        if (cutoff && level >= cutoff && num > 1) {
+            // a large subtree, let idle threads steal all placements but the first
+            // a min node passes its window to every placement, but a bound of a placement would be averaged
+            // as if it were exact, so an expectation node searches its placements with full windows
+            float lo = expect ? -FLT_MAX : alpha, hi = expect ? FLT_MAX : beta;
+            float result[max_spawns];
+            pool::group pending;
+            const board base(after);
+            for (int i = 1; i < num; i++) {
+                workers->spawn(pending, [&, i](size_t w) {
+                    board b(base);
+                    apply(b, child[i]);
+                    result[i] = child[i].reward + before_value(searchers[w], b, level - 1, lo - child[i].reward, hi - child[i].reward);
+                }, s.id);
+            }
+            board::undo undo = after.save();
+            apply(after, child[0]);
+            result[0] = child[0].reward + before_value(s, after, level - 1, lo - child[0].reward, hi - child[0].reward);
+            after.unplace(child[0].pos, undo);
+            workers->wait(pending, s.id);
+            if (expect) {
+                value = 0;
+                for (int i = 0; i < num; i++) value += child[i].prob * result[i];
+            } else {
+                value = num ? *std::min_element(result, result + num) : FLT_MAX;
+            }
+            if (prune && !expect && value <= alpha) type = transposition::upper;
+            if (prune && !expect && value >= beta) type = transposition::lower;
+        } else if (expect) {
+            value = expect_value(s, after, child, num, level, alpha, beta, type);
+        } else {
+            value = worst_value(s, after, child, num, level, alpha, beta, type);
+        }
+
+        if (tt && !aborted) tt->store(key, value, level, -1, type, s.lookups);
+        return value;
+    }
+
+    // the min node: the environment places the worst tile for the player
+    float worst_value(searcher& s, board& after, const spawn child[], int num, int level, float alpha, float beta, int& type) {
         float worst_value = FLT_MAX;
+        float ceiling = beta;
+        board::undo undo = after.save();
+        for (int i = 0; i < num; i++) {
+            apply(after, child[i]);
+            float value = child[i].reward + before_value(s, after, level - 1, alpha - child[i].reward, ceiling - child[i].reward);
+            after.unplace(child[i].pos, undo);
+            if (value < worst_value) {
+                worst_value = value;
+            }
+            if (prune && worst_value <= alpha) break;
+            ceiling = std::min(ceiling, worst_value);
+        }
+        if (prune && worst_value <= alpha) type = transposition::upper;
+        else if (prune && num && worst_value >= beta) type = transposition::lower;
+        return worst_value;
+    }
 
-        std::uniform_int_distribution<int> popup1(0, 20);
-        if (after.can_place_bonus_tile() && popup1(engine) == 0) {
-            for (int pos = 0; pos < 16; pos++) {
-                if ((last_op == 0) && (pos < 12))       continue;
-                if ((last_op == 1) && (pos % 4 != 0))   continue;
-                if ((last_op == 2) && (pos > 3))        continue;
-                if ((last_op == 3) && (pos % 4 != 3))   continue;
-                if (after(pos) != 0) continue;
+    /**
+     * the chance node: the expected value over the placements
+     *
+     * with prune=1 and bounds=L:U (the range of a placement's value), Star1 cuts the node once the remaining
+     * placements can no longer move the value into (alpha, beta)
+     * with prune=2 and a transposition table, Star2 first probes one slide of each placement for a lower bound
+     */
+    float expect_value(searcher& s, board& after, const spawn child[], int num, int level, float alpha, float beta, int& type) {
+        board::undo undo = after.save();
+        if (!prune || !bounded) {
+            float sum = 0;
+            for (int i = 0; i < num; i++) {
+                apply(after, child[i]);
+                sum += child[i].prob * (child[i].reward + before_value(s, after, level - 1));
+                after.unplace(child[i].pos, undo);
+            }
+            return sum;
+        }
 
-                board tmp = board(after);
-                tmp.info(4);
-                board::reward reward = tmp.place(pos, hint);
-                if (reward != -1) {
-                    float value = reward + before_value(tmp, level - 1);
-                    if (value < worst_value) {
-                        worst_value = value;
-                    }
-                }
+        float lower[max_spawns], rest_lower = 0;
+        for (int i = 0; i < num; i++) lower[i] = vmin;
+        if (star2 && tt && level > 2) {
+            // Star2 probing, the slide tried first by a max node is a lower bound of its value
+            for (int i = 0; i < num; i++) {
+                board tmp(after);
+                apply(tmp, child[i]);
+                int op = probe_op(s, tmp, level - 1);
+                if (op == -1) continue;
+                float probe = child[i].reward + tmp.slide(op) + after_value(s, tmp, op, level - 2);
+                lower[i] = std::max(vmin, std::min(probe, vmax));
             }
         }
-        else {
-            std::uniform_int_distribution<int> popup2(1, 3);
-            for (int t : { 1, 2, 3 }) for (int pos = 0; pos < 16; pos++) {
-                if ((last_op == 0) && (pos < 12))       continue;
-                if ((last_op == 1) && (pos % 4 != 0))   continue;
-                if ((last_op == 2) && (pos > 3))        continue;
-                if ((last_op == 3) && (pos % 4 != 3))   continue;
-                if (after(pos) != 0) continue;
+        for (int i = 0; i < num; i++) rest_lower += child[i].prob * lower[i];
+        if (rest_lower >= beta) {
+            type = transposition::lower;
+            return rest_lower;
+        }
 
-                board tmp = board(after);
-                tmp.info(t);
-                board::reward reward = tmp.place(pos, hint);
-                if (reward != -1) {
-                    float value = reward + before_value(tmp, level - 1);
-                    if (value < worst_value) {
-                        worst_value = value;
-                    }
-                }
+        // Star1, sum holds the placements searched so far, rest the probability of the others
+        float sum = 0, rest = 1;
+        for (int i = 0; i < num; i++) {
+            float p = child[i].prob;
+            rest = std::max(rest - p, 0.0f);
+            rest_lower -= p * lower[i];
+            float a = (alpha - sum - rest * vmax) / p; // a placement value at or below a fails the node low
+            float b = (beta - sum - rest_lower) / p; // a placement value at or above b fails the node high
+            float lo = std::max(a, lower[i]), hi = std::min(b, vmax);
+            apply(after, child[i]);
+            float value = child[i].reward + before_value(s, after, level - 1, lo - child[i].reward, hi - child[i].reward);
+            after.unplace(child[i].pos, undo);
+            sum += p * value;
+            if (value <= a) {
+                type = transposition::upper;
+                return sum + rest * vmax;
+            }
+            if (value >= b) {
+                type = transposition::lower;
+                return sum + rest_lower;
             }
         }
+        return sum;
+    }
 
-        return worst_value;
+    // return the slide a max node would search first: the stored best one, or the first legal one
+    int probe_op(searcher& s, const board& before, int level) {
+        transposition::result known;
+        if (tt->find(transposition::hash(before, transposition::before, level), known, s.lookups) && known.best != -1) return known.best;
+        if (level > 2 && tt->find(transposition::hash(before, transposition::before, level - 2), known, s.lookups) && known.best != -1) return known.best;
+        for (int op : { 0, 1, 2, 3 }) {
+            board tmp(before);
+            if (tmp.slide(op) != -1) return op;
+        }
+        return -1;
     }
 
     // return the best board value
-    float before_value(const board& before, int level) {
+    float before_value(searcher& s, const board& before, int level, float alpha = -FLT_MAX, float beta = FLT_MAX) {
+        s.nodes++;
+        if (timeout(s)) return 0;
+        uint64_t key = 0;
+        transposition::result known;
+        int order[4] = { 0, 1, 2, 3 };
+        if (tt) {
+            key = transposition::hash(before, transposition::before, level);
+            if (tt->find(key, known, s.lookups) && usable(known, alpha, beta)) return known.value;
+            // try the best op of the previous (shallower) iteration first
+            if (level > 2 && tt->find(transposition::hash(before, transposition::before, level - 2), known, s.lookups) && known.best > 0)
+                std::swap(order[0], order[known.best]);
+        }
+
+        board after[4];
+        board::reward reward[4];
+        for (int op = 0; op < 4; op++) {
+            after[op] = before;
+            reward[op] = after[op].slide(op);
+        }
+        // the slides of a level 2 node (or below) are leaves, evaluate them as one batch
+        // (except with prune=1, where most of them are cut off after the first one)
+        float leaf[4];
+        bool batched = level <= 2 && !prune;
+        if (batched) {
+            board batch[4];
+            int ops[4], n = 0;
+            for (int op = 0; op < 4; op++) {
+                if (reward[op] == -1) continue;
+                s.nodes++;
+                if (timeout(s)) return 0;
+                batch[n] = after[op];
+                ops[n++] = op;
+            }
+            float value[4];
+            evaluate_batch(s, batch, n, value);
+            for (int i = 0; i < n; i++) leaf[ops[i]] = value[i];
+        }
+
         float best_value = -FLT_MAX;
-        for (int op : {0, 1, 2, 3}) {
-            board tmp(before);
-            board::reward reward = tmp.slide(op);
-            if (reward != -1) {
-                float value = reward + after_value(tmp, op, level - 1);
+        int best_op = -1;
+        int type = transposition::exact;
+        float floor = alpha;
+        for (int op : order) {
+            if (reward[op] != -1) {
+                float value = reward[op] + (batched ? leaf[op] : after_value(s, after[op], op, level - 1, floor - reward[op], beta - reward[op]));
                 if (value > best_value) {
                     best_value = value;
+                    best_op = op;
                 }
+                if (prune && best_value >= beta) break;
+                floor = std::max(floor, best_value);
             }
         }
-        return best_value != -FLT_MAX ? best_value : 0.0;
+        if (best_value == -FLT_MAX) best_value = 0.0;
+        else if (prune && best_value >= beta) type = transposition::lower;
+        else if (prune && best_value <= alpha) type = transposition::upper;
+        if (tt && !aborted) tt->store(key, best_value, level, best_op, type, s.lookups);
+        return best_value;
+    }
+
+    /**
+     * start the search of a move, the transposition table is kept from the last move
+     * so the subtree of the actual placement is still warm, unless the weights were trained since
+     */
+    void begin_search() {
+        searches++;
+        if (!tt) return;
+        uint32_t version = net_version.load();
+        if (version != known) {
+            tt->clear();
+            known = version;
+        }
+        tt->age();
+    }
+
+    // whether a stored value answers a search with the window (alpha, beta)
+    static bool usable(const transposition::result& known, float alpha, float beta) {
+        return known.type == transposition::exact
+            || (known.type == transposition::lower && known.value >= beta)
+            || (known.type == transposition::upper && known.value <= alpha);
+    }
+
+    // check the deadline of a timed search every 1024 nodes, and abort the search once it has passed
+    bool timeout(searcher& s) {
+        if (!timed) return false;
+        if (!aborted && (s.nodes & 1023) == 0 && std::chrono::steady_clock::now() >= deadline) aborted = true;
+        return aborted;
     }
 
 protected:
@@ -184,7 +690,27 @@ protected:
         operator numeric() const { return numeric(std::stod(value)); }
     };
     std::map<key, value> meta;
-    std::default_random_engine engine;
+    xoshiro origin; // the stream of the seed and lane, the others are jumps ahead of it
+    xoshiro engine;
+    std::shared_ptr<transposition> tt;
+    std::shared_ptr<pool> workers;
+    std::vector<searcher> searchers;
+    uint64_t salt;
+    int cutoff;
+    bool expect;
+    bool enumerate;
+    bool prune;
+    bool star2;
+    bool bounded;
+    float vmin;
+    float vmax;
+    size_t searches;
+    bool timed;
+    std::atomic<bool> aborted;
+    std::chrono::steady_clock::time_point deadline;
+    uint32_t known; // the weight version of the transposition table entries
+
+    static const int max_spawns = 4 * 9 * 4; // positions, bonus tiles, and next hints
 };
 
 /**
@@ -195,41 +721,182 @@ class player : public agent {
 public:
     player(const std::string& args = "") :
         agent("name=learning role=player " + args),
+        batch_size(0),
         opcode({ 0, 1, 2, 3 }),
-        alpha(0.003125f) {
+        alpha(0.003125f),
+        depth(3),
+        budget(0),
+        adaptive(false),
+        pace(0),
+        average(0),
+        verify(false),
+        verified(0),
+        mismatched(0),
+        pondering(false) {
         if (meta.find("alpha") != meta.end())
             alpha = float(meta["alpha"]);
+        if (meta.find("depth") != meta.end() && meta["depth"].value == "auto") // pass depth=auto to choose the depth by the board
+            adaptive = true;
+        else if (meta.find("depth") != meta.end()) // pass depth=... for the search depth, or the depth limit with budget
+            depth = std::max(int(meta["depth"]), 1) | 1; // a search ends on after-states, so the depth is odd
+        if (meta.find("pace") != meta.end()) // pass pace=ms to keep the average time per move of depth=auto
+            pace = float(meta["pace"]);
+        if (meta.find("budget") != meta.end()) { // pass budget=ms to deepen the search until the time is used up
+            budget = int(meta["budget"]);
+            if (meta.find("depth") == meta.end()) depth = 15;
+        }
+        if (meta.find("verify") != meta.end()) // pass verify=1 with prune=1 to check the pruned choices against a full search
+            verify = int(meta["verify"]);
+        if (meta.find("ponder") != meta.end()) // pass ponder=1 with tt=... to search during the opponent's turn in the shell
+            pondering = int(meta["ponder"]);
         if (meta.find("load") != meta.end()) // pass load=... to load from a specific file
             load_weights(meta["load"]);
         else
             init_weights();
+        if (meta.find("learning") != meta.end() && meta["learning"].value == "tc") // pass learning=tc for temporal coherence
+            for (weight& w : net) w.enable_coherence();
+        if (meta.find("schedule") != meta.end()) { // pass schedule=step|exp|cosine|plateau to decay alpha
+            float decay = meta.find("decay") != meta.end() ? float(meta["decay"]) : 0.75f;
+            size_t period = meta.find("period") != meta.end() ? size_t(meta["period"]) : 250000;
+            float min = meta.find("alpha_min") != meta.end() ? float(meta["alpha_min"]) : 0.0f;
+            size_t patience = meta.find("patience") != meta.end() ? size_t(meta["patience"]) : 1;
+            lr = schedule(meta["schedule"], alpha, decay, period, min, patience);
+        } else {
+            lr = schedule("const", alpha);
+        }
+        if (meta.find("replay") != meta.end()) { // pass replay=N batch=M to replay M of the last N after-states per episode
+            buffer = replay(size_t(meta["replay"]));
+            batch_size = meta.find("batch") != meta.end() ? size_t(meta["batch"]) : 32;
+        }
+        load_streams();
     }
     ~player() {
+        stop_pondering();
         if (meta.find("save") != meta.end()) // pass save=... to save to a specific file
             save_weights(meta["save"]);
+        save_streams();
     }
 
 public:
     virtual void open_episode(const std::string& flag = "") {
-        record.clear();
+        begin_game(current);
     }
     virtual void close_episode(const std::string& flag = "") {
+        end_game(current);
+    }
+
+    struct game;
+    // start a game, or finish one and learn from its record
+    void begin_game(game& g) {
+        g.record.clear();
+        g.tiles_left = -1;
+    }
+    void end_game(game& g) {
+        std::vector<after_state>& record = g.record;
         if (record.size() <= 0) return ;
 
-        after_state last = record[ record.size()-1 ];
+        train_record(record);
+
+        if (buffer.capacity()) {
+            for (size_t i = 0; i < record.size(); i++)
+                buffer.push(record[i].b, record[i].reward, i + 1 == record.size());
+            replay_weights();
+        }
+    }
+    /**
+     * set alpha by the learning rate schedule after n finished episodes,
+     * or after a finished block with its average score, which drives the plateau schedule
+     */
+    void adjust_learning_rate(size_t n) { alpha = lr(n); }
+    void end_block(double average) { alpha = lr.end_block(average); }
+
+    /**
+     * search the placements that may follow our slide in a background thread, with ponder=1
+     * each placed board is searched at the level the next move searches its slides,
+     * so the next move finds them in the transposition table; iterative deepening ponders deeper and deeper
+     */
+    virtual void ponder(const board& state, action move) {
+        if (!pondering || !tt || move.type() != action::slide::type) return;
+        stop_pondering();
+        board after(state);
+        int op = move.event() & 0b11;
+        if (enumerate) after.info(hint_of(after) | (board::data(current.tiles_left) << 8));
+        deadline = std::chrono::steady_clock::time_point::max();
+        timed = true;
+        thinker = std::thread([this, after, op]() {
+            spawn child[max_spawns];
+            int num = expand(searchers[0], after, op, child);
+            for (int level = budget ? 2 : depth + 1; level <= depth + 1 && !aborted; level += 2) {
+                for (int i = 0; i < num && !aborted; i++) {
+                    board b(after);
+                    apply(b, child[i]);
+                    before_value(searchers[0], b, level);
+                }
+            }
+        });
+    }
+    // cancel the background search, its unfinished nodes are not stored
+    virtual void stop_pondering() {
+        if (!thinker.joinable()) return;
+        aborted = true;
+        thinker.join();
+        timed = aborted = false;
+    }
+
+    virtual std::string search_summary() const {
+        std::stringstream ss;
+        ss << agent::search_summary();
+        if (verify) ss << ", verify: " << mismatched << " of " << verified << " moves differ";
+        return ss.str();
+    }
+
+    /**
+     * learn from a recorded game, given all moves of the episode in order
+     * the after-states are rebuilt by replaying the moves, the hint of an after-state is the next placed tile
+     * the tile counters are kept as spawner::place does, so stage=bonus trains the same tables as self-play
+     *
+     * this only touches the shared weights, so several threads may learn from different games at once
+     */
+    void learn_from(const std::vector<action>& moves) {
+        std::vector<after_state> path;
+        board b;
+        for (size_t i = 0; i < moves.size(); i++) {
+            board::reward reward = moves[i].apply(b);
+            if (reward == -1) break;
+            if (moves[i].type() != action::slide::type) {
+                if (i == 0) b.add_tile(); // the first placement draws its tile and the next hint
+                b.add_tile();
+                continue;
+            }
+            board::cell hint = 0;
+            if (i + 1 < moves.size() && moves[i + 1].type() == action::place::type)
+                hint = std::min(action::place(moves[i + 1]).tile(), 4u);
+            if (hint > 3) b.add_bonus_tile(); // a bonus tile is counted when it becomes the hint
+            board after(b);
+            after.info(hint);
+            path.emplace_back(after, reward);
+        }
+        if (path.size()) train_record(path);
+    }
+
+private:
+    struct after_state;
+
+    // train the after-states of one episode backward from its end
+    void train_record(const std::vector<after_state>& path) {
+        const after_state& last = path[path.size() - 1];
         train_weights(last.b, last.b, 0);
-        for(int i = record.size() - 2; i >= 0; i--){
-            after_state current = record[i];
-            after_state next = record[i + 1];
+        for (int i = path.size() - 2; i >= 0; i--) {
+            const after_state& current = path[i];
+            const after_state& next = path[i + 1];
             train_weights(current.b, next.b, next.reward);
         }
+        net_version++;
     }
-    virtual void reduce_learning_rate() { alpha *= 0.75; }
 
-private:
     void train_weights(const board& current, const board& next, const int reward = 0) {
-        float td_target, update_value;
-        int hint = current.info() > 3 ? 0 : current.info();
+        float td_target, td_error;
+        int offset = table_offset(current);
 
         // for the final state
         if (current == next && reward == 0) {
@@ -238,43 +905,225 @@ private:
         else {
             td_target = reward + state_approximation(next);
         }
-        update_value = alpha * (td_target - state_approximation(current));
+        td_error = td_target - state_approximation(current);
+
+        // with temporal coherence, each weight further scales alpha by its own |E| / A
+        int index[8 * tuple_num];
+        features(current, index);
+        for (int j = 0; j < 8 * tuple_num; j++) net[offset + (j % tuple_num) * 4].update(index[j], alpha, td_error);
+    }
 
-        board tmp(current);
-        for (int k = 0; k < 4; k++) {
-            if (k > 0)  tmp.rotate_right();
-            for (int i = 0; i < tuple_num; i++) net[i * 4 + hint][tuple_index(tmp, i)] += update_value;
-            tmp.reflect_vertical();
-            for (int i = 0; i < tuple_num; i++) net[i * 4 + hint][tuple_index(tmp, i)] += update_value;
-            tmp.reflect_vertical();
+    // train a mini-batch drawn from the replay buffer, sorted by the first feature index for locality
+    void replay_weights() {
+        buffer.sample(batch_size, engine, batch);
+        order.clear();
+        for (size_t i : batch) {
+            board b = buffer.at(i).state();
+            order.emplace_back((table_offset(b) << 24) | tuple_index(b, 0), i);
         }
+        std::sort(order.begin(), order.end());
+        for (auto& item : order) {
+            const replay::transition& current = buffer.at(item.second);
+            if (current.last) {
+                board b = current.state();
+                train_weights(b, b, 0);
+            } else {
+                const replay::transition& next = buffer.next(item.second);
+                train_weights(current.state(), next.state(), next.reward);
+            }
+        }
+        net_version++;
     }
 
 public:
     virtual action take_action(board& before, action prev) {
-        float best_value = -FLT_MAX;
-        int best_op = -1, best_reward;
-        board best_state;
+        prepare(current, before);
+        return decide(current, before);
+    }
 
-        // choose the best slide op
+    /**
+     * the first half of a move: collect the legal slide ops of the board
+     * a 1-ply search (depth=1) also computes the features of the after-states and prefetches their weights,
+     * so that several games played at once can look up the weights of their moves together
+     */
+    void prepare(game& g, const board& before) {
+        begin_search();
+        if (enumerate) track_bag(g, before);
+
+        g.legal = 0;
         for (int op : opcode) {
-            board tmp = board(before);
-            board::reward reward = tmp.slide(op);
-            if (reward != -1) {
-                float value = reward + after_value(tmp, op, 3);
-                if (value > best_value) {
-                    best_value = value;
-                    best_reward = reward;
-                    best_op = op;
-                    best_state = tmp;
-                }
+            g.after[op] = board(before);
+            if (enumerate) g.after[op].info(hint_of(before) | (board::data(g.tiles_left) << 8));
+            g.reward[op] = g.after[op].slide(op);
+            if (g.reward[op] != -1) g.order[g.legal++] = op;
+        }
+
+        g.prepared = depth == 1 && !budget && !adaptive;
+        for (int i = 0; i < g.legal && g.prepared; i++) {
+            int op = g.order[i];
+            g.offset[op] = table_offset(g.after[op]);
+            features(g.after[op], g.index[op]);
+            for (int j = 0; j < 8 * tuple_num; j++) net[g.offset[op] + (j % tuple_num) * 4].prefetch(g.index[op][j]);
+        }
+    }
+
+    // the second half of a move: search the prepared slide ops and return the best one
+    action decide(game& g, const board& before) {
+        board* after = g.after;
+        board::reward* reward = g.reward;
+        int* order = g.order;
+        int legal = g.legal;
+        if (legal == 0) return action();
+
+        auto start = std::chrono::steady_clock::now();
+        int limit = adaptive ? adaptive_depth(before, legal) : depth;
+        int best_op;
+        float value[4];
+        salt = searchers[0].engine();
+        if (limit == 0) {
+            best_op = order[0];
+        } else if (g.prepared) {
+            // a 1-ply search on the prefetched features
+            for (int i = 0; i < legal; i++) value[order[i]] = reward[order[i]] + sum_features(g.offset[order[i]], g.index[order[i]]);
+            searchers[0].nodes += legal;
+            rank(order, legal, value);
+            best_op = order[0];
+        } else if (budget == 0) {
+            best_op = search_root(after, reward, order, legal, limit, value);
+            if (verify && prune) verify_root(after, reward, order, legal, limit, best_op);
+        } else {
+            // iterative deepening, keep the best op of the last completed depth
+            deadline = start + std::chrono::milliseconds(budget);
+            timed = true;
+            best_op = order[0];
+            for (int level = 1; level <= limit; level += 2) {
+                int op = search_root(after, reward, order, legal, level, value);
+                if (aborted) break;
+                best_op = op;
+                // an iteration takes several times as long as the last one, do not start one that cannot finish
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                if (elapsed * 2 > std::chrono::milliseconds(budget)) break;
             }
+            timed = aborted = false;
         }
-        if (best_op != -1) {
-            record.emplace_back(best_state, best_reward);
-            return action::slide(best_op);
+        if (adaptive) {
+            std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            average += (elapsed.count() - average) * 0.01f;
         }
-        return action();
+
+        after[best_op].info(hint_of(before));
+        g.record.emplace_back(after[best_op], reward[best_op]);
+        return action::slide(best_op);
+    }
+
+private:
+    /**
+     * follow the tile bag of the environment by the hints, for spawns=all
+     * the 9 initial tiles and the first hint come from a fresh bag, and every later 1, 2, or 3-tile hint
+     * is one more draw; the bag becomes unknown if the hints do not fit
+     */
+    void track_bag(game& g, const board& before) {
+        int& tiles_left = g.tiles_left;
+        int hint = hint_of(before);
+        if (tiles_left == -1) {
+            int left[3] = { 4, 4, 4 }, drawn = 0;
+            for (int i = 0; i < 16; i++) if (before(i) >= 1 && before(i) <= 3) left[before(i) - 1]--, drawn++;
+            if (hint >= 1 && hint <= 3) left[hint - 1]--, drawn++;
+            bool valid = drawn == 10 && left[0] >= 0 && left[1] >= 0 && left[2] >= 0;
+            tiles_left = valid ? left[0] | (left[1] << 4) | (left[2] << 8) : 0;
+        } else if (tiles_left && hint >= 1 && hint <= 3) {
+            if (((tiles_left >> ((hint - 1) * 4)) & 0xf) == 0) tiles_left = 0;
+            else if ((tiles_left -= 1 << ((hint - 1) * 4)) == 0) tiles_left = 0x444; // the bag is refilled once it is empty
+        }
+    }
+
+    /**
+     * choose the search depth of depth=auto by the board
+     * a forced move is not searched, a sparse board gets a shallow search,
+     * and a crowded board, two legal moves, or a 768-tile and above get a deeper one
+     * with pace=ms, the depth is lowered while the moving average time per move is above the pace,
+     * and raised while it is well below; with budget=ms, the depth is the limit of the deepening
+     */
+    int adaptive_depth(const board& before, int legal) {
+        if (legal == 1) return 0;
+        int empty = __builtin_popcount(before.empty_mask());
+        int level = depth;
+        if (empty >= 10) level -= 2;
+        else if (empty <= 3 || legal == 2 || before.get_largest() >= 10) level += 2;
+        if (pace > 0 && average > pace) level -= 2;
+        else if (pace > 0 && average * 4 < pace) level += 2;
+        return std::max(level, 1);
+    }
+
+    /**
+     * search the given ops at the level and return the best one, the ops are then reordered by value
+     * with prune=1, the value of an op other than the best one may be an upper bound
+     * with a search pool, the ops (or with split=chance, all their placements) are searched in parallel
+     */
+    int search_root(const board after[4], const board::reward reward[4], int order[4], int legal, int level, float value[4]) {
+        if (!workers) {
+            float best = -FLT_MAX;
+            for (int i = 0; i < legal; i++) {
+                int op = order[i];
+                board b(after[op]);
+                value[op] = reward[op] + after_value(searchers[0], b, op, level, best - reward[op]);
+                best = std::max(best, value[op]);
+                if (aborted) return -1;
+            }
+        } else if (level == 1 || meta.find("split") == meta.end() || meta["split"].value != "chance") {
+            workers->run(legal, [&](size_t i, size_t w) {
+                int op = order[i];
+                board b(after[op]);
+                value[op] = reward[op] + after_value(searchers[w], b, op, level);
+            });
+        } else {
+            spawn child[4][max_spawns];
+            float result[4][max_spawns];
+            std::vector<std::pair<int, int>> tasks;
+            for (int i = 0; i < legal; i++) {
+                int op = order[i];
+                searchers[0].nodes++;
+                int num = expand(searchers[0], after[op], op, child[op]);
+                for (int k = 0; k < num; k++) tasks.emplace_back(op, k);
+                value[op] = expect ? 0 : FLT_MAX;
+            }
+            workers->run(tasks.size(), [&](size_t i, size_t w) {
+                const spawn& c = child[tasks[i].first][tasks[i].second];
+                board b(after[tasks[i].first]);
+                apply(b, c);
+                result[tasks[i].first][tasks[i].second] = c.reward + before_value(searchers[w], b, level - 1);
+            });
+            for (auto& task : tasks) {
+                float res = result[task.first][task.second];
+                if (expect) value[task.first] += child[task.first][task.second].prob * res;
+                else value[task.first] = std::min(value[task.first], res);
+            }
+            for (int i = 0; i < legal; i++) value[order[i]] += reward[order[i]];
+        }
+        if (aborted) return -1;
+        rank(order, legal, value);
+        return order[0];
+    }
+
+    // sort the ops by value, best first and stable on ties, by insertion since the buffer of std::stable_sort is allocated
+    static void rank(int order[], int legal, const float value[]) {
+        for (int i = 1; i < legal; i++) {
+            int op = order[i], j = i;
+            for (; j > 0 && value[order[j - 1]] < value[op]; j--) order[j] = order[j - 1];
+            order[j] = op;
+        }
+    }
+
+    // with verify=1, search again without pruning and count the moves whose pruned choice is worse
+    void verify_root(const board after[4], const board::reward reward[4], const int order[4], int legal, int level, int chosen) {
+        int check[4];
+        float exact[4];
+        std::copy(order, order + legal, check);
+        prune = false;
+        search_root(after, reward, check, legal, level, exact);
+        prune = true;
+        verified++;
+        if (exact[chosen] < exact[check[0]] - 1e-4f * std::max(1.0f, std::fabs(exact[check[0]]))) mismatched++;
     }
 
 private:
@@ -283,11 +1132,161 @@ private:
         int reward;
         after_state(board b = {}, int reward = 0) : b(b), reward(reward) {}
     };
-    std::vector<after_state> record;
+
+public:
+    // the state of one game, so that several games can be played at once by prepare() and decide()
+    struct game {
+        std::vector<after_state> record;
+        int tiles_left; // the tile bag of spawns=all, -1 before the first slide of an episode
+        board after[4];
+        board::reward reward[4];
+        int order[4];
+        int legal;
+        bool prepared; // whether the after-states are evaluated from the prefetched features
+        int offset[4];
+        int index[4][8 * tuple_num];
+        game() : tiles_left(-1), legal(0), prepared(false) {}
+    };
+
+private:
+    game current;
+    replay buffer;
+    size_t batch_size;
+    std::vector<size_t> batch;
+    std::vector<std::pair<int, size_t>> order;
 
 private:
     std::array<int, 4> opcode;
     float alpha;
+    int depth;
+    int budget;
+    bool adaptive;
+    float pace;
+    float average;
+    bool verify;
+    size_t verified;
+    size_t mismatched;
+    schedule lr;
+    bool pondering;
+    std::thread thinker;
+};
+
+/**
+ * the random placement of the environments
+ * the next hint is a tile drawn from the tile bag, or a bonus tile with 1/21 probability after a slide,
+ * and the tile is placed on a random empty cell (after a slide, on the edge the board slid away from)
+ * positions and tiles are drawn as set bits of the legal-spawn mask and the tile bag
+ */
+struct spawner {
+    int tile_bag;
+    xoshiro rng;
+
+    spawner(const xoshiro& rng = xoshiro()) : tile_bag((1 << 12) - 1), rng(rng) {}
+
+    void reset() { tile_bag = (1 << 12) - 1; }
+
+    action place(board& after, action prev) {
+        board::undo u = after.save();
+        board::cell hint = u.attr;
+        int op = prev.type() == action::place::type ? -1 : prev.event() & 0b11;
+        action move = place(rng, tile_bag, hint, u.num_tile, u.num_bonus_tile, after.get_largest(), after.empty_mask(), op);
+        u.attr = hint;
+        after.restore(u);
+        return move;
+    }
+
+    /**
+     * the placement rules on the parts of a game they read and change, shared with the batch of games
+     * hint is the next tile (0 before the first place) and becomes the one after, tiles and bonus are the tile counters,
+     * empty is the empty cells, and op is the last slide, or -1 for the first 9 places
+     * return the place, or an invalid action if no cell is legal
+     */
+    static action place(xoshiro& rng, int& bag, board::cell& hint, int& tiles, int& bonus,
+                        board::cell largest, int empty, int op) {
+        board::cell tile = hint;
+        // for the first place
+        if (tile == 0) {
+            tile = draw_hint(rng, bag);
+            tiles++;
+        }
+
+        // for first 9 place
+        if (op < 0) {
+            hint = draw_hint(rng, bag);
+            tiles++;
+            return empty ? action::place(rng.pick(empty), tile) : action();
+        }
+
+        // for place after slide
+        if (tile > 3) tile = draw_bonus(rng, largest);
+        // choose hint tile, with 1/21 probability to place bonus tile
+        if (draw_bonus_hint(rng, largest, tiles, bonus)) {
+            hint = 4;
+            bonus++;
+        } else {
+            hint = draw_hint(rng, bag);
+        }
+        tiles++;
+
+        // randomly choose one legal position
+        int legal = empty & edge[op];
+        return legal ? action::place(rng.pick(legal), tile) : action();
+    }
+
+    // take a random tile out of the bag, and refill the bag once it is empty
+    static board::cell draw_hint(xoshiro& rng, int& bag) {
+        int t = rng.pick(bag);
+        bag ^= (1 << t);
+        if (bag == 0)  bag = (1 << 12) - 1;
+        return t / 4 + 1;
+    }
+    // randomly choose bonus tile: 6-tile to (Vmax/8)-tile
+    board::cell draw_bonus(const board& after) { return draw_bonus(rng, after.get_largest()); }
+    static board::cell draw_bonus(xoshiro& rng, board::cell largest) { return 4 + rng.below(largest - 6); }
+    bool draw_bonus_hint(const board& after) { return after.can_place_bonus_tile() && rng.below(21) == 0; }
+    static bool draw_bonus_hint(xoshiro& rng, board::cell largest, int tiles, int bonus) {
+        return board::can_place_bonus_tile(largest, tiles, bonus) && rng.below(21) == 0;
+    }
+
+    // the cells a tile may be placed on after slide up, right, down, or left
+    static constexpr int edge[4] = { 0xf000, 0x1111, 0x000f, 0x8888 };
+};
+constexpr int spawner::edge[4];
+
+/**
+ * random environment for self-play training, with the same placements as rndenv name=random
+ * it has no weights and no search, and as a final type its placement is called directly, not virtually
+ */
+class trainenv final : public agent {
+public:
+    trainenv(const std::string& args = "") : agent("name=random role=environment " + args), random(stream(1)) { load_streams(); }
+    ~trainenv() { save_streams(); }
+
+    // whether an environment with the given args is a random one, the last name= counts as in the meta
+    static bool suits(const std::string& args) {
+        std::stringstream ss(args);
+        std::string name = "random";
+        for (std::string pair; ss >> pair; ) {
+            if (pair.find("name=") == 0) name = pair.substr(5);
+        }
+        return name == "random";
+    }
+
+    virtual void open_episode(const std::string& flag = "") { random.reset(); }
+    virtual action take_action(board& after, action prev) { return random.place(after, prev); }
+
+    // the placement stream, e.g., for a batch of games that draws its placements the same way
+    xoshiro& placements() { return random.rng; }
+
+protected:
+    virtual std::vector<xoshiro*> streams() {
+        std::vector<xoshiro*> all = agent::streams();
+        all.push_back(&random.rng);
+        return all;
+    }
+
+private:
+    spawner random;
 };
 
 /**
@@ -296,7 +1295,7 @@ private:
  * tile bag contain 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 tile
  * once the tile bag is empty, reset it
  * with 1/21 probability to place bonus tile
- * choose worst position to let player get less score
+ * choose worst position to let player get less score, unless its name is random
  */
 class rndenv : public agent {
 public:
@@ -304,151 +1303,105 @@ public:
         agent("name=random role=environment " + args),
         space({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }),
         bag({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 }),
-        tile_bag((1 << 12) - 1),
-        popup(0, 20) {
+        random(stream(1)), adversarial(name() != "random") {
         if (meta.find("load") != meta.end()) // pass load=... to load from a specific file
             load_weights(meta["load"]);
         else
             init_weights();
+        load_streams();
     }
+    ~rndenv() { save_streams(); }
 
-    virtual void open_episode(const std::string& flag = "") { tile_bag = (1 << 12) - 1; }
+    virtual void open_episode(const std::string& flag = "") { random.reset(); }
+
+protected:
+    virtual std::vector<xoshiro*> streams() {
+        std::vector<xoshiro*> all = agent::streams();
+        all.push_back(&random.rng);
+        return all;
+    }
 
+public:
     virtual action take_action(board& after, action prev) {
-        std::shuffle(space.begin(), space.end(), engine);
-        std::shuffle(bag.begin(), bag.end(), engine);
+        if (!adversarial || prev.type() == action::place::type) return random.place(after, prev);
 
+        // for place after slide
         board::cell tile = after.info();
-        // for the first place
-        if (tile == 0) {
-            tile = bag[0];
-            tile_bag ^= (1 << tile);
-            tile = tile / 4 + 1;
-            after.add_tile();
-        }
+        if (tile > 3) tile = random.draw_bonus(after);
+        int slide_op = prev.event() & 0b11;
 
-        // for first 9 place
-        if (prev.type() == action::place::type) {
-            // choose hint tile
-            for (int t : bag) {
-                if (tile_bag & (1 << t)) {
-                    after.info(t / 4 + 1);
-                    tile_bag ^= (1 << t);
-                    if (tile_bag == 0)  tile_bag = (1 << 12) - 1;
-                    break;
-                }
-            }
+        // for playing, choose the worst position and hint tile to minimize score
+        float worst_value = FLT_MAX;
+        int worst_pos = -1;
+        begin_search();
+        salt = searchers[0].engine();
+        std::shuffle(space.begin(), space.end(), engine);
+        std::shuffle(bag.begin(), bag.end(), engine);
+
+        // choose hint tile, with 1/21 probability to place bonus tile
+        if (random.draw_bonus_hint(after)) {
+            after.info(4);
+            after.add_bonus_tile();
             after.add_tile();
 
             for (int pos : space) {
+                if(slide_op == 0 && pos < 12)       continue;
+                if(slide_op == 1 && pos % 4 != 0)   continue;
+                if(slide_op == 2 && pos > 3)        continue;
+                if(slide_op == 3 && pos % 4 != 3)   continue;
                 if (after(pos) != 0) continue;
-                return action::place(pos, tile);
-            }
-        }
-        // for place after slide
-        else {
-            if (tile > 3) {
-                // randomly choose bonus tile: 6-tile to (Vmax/8)-tile
-                std::uniform_int_distribution<int> popup_bonus(4, after.get_largest() - 3);
-                tile = popup_bonus(engine);
-            }
 
-            int slide_op = prev.event() & 0b11;
-            // for training
-            if (name() == "random") {
-                // choose hint tile, with 1/21 probability to place bonus tile
-                if (after.can_place_bonus_tile() && popup(engine) == 0) {
-                    after.info(4);
-                    after.add_bonus_tile();
-                    after.add_tile();
-                }
-                else {
-                    for (int t : bag) {
-                        if (tile_bag & (1 << t)) {
-                            after.info(t / 4 + 1);
-                            tile_bag ^= (1 << t);
-                            if (tile_bag == 0)  tile_bag = (1 << 12) - 1;
-                            break;
-                        }
+                board tmp = board(after);
+                board::reward reward = tmp.place(pos, tile);
+                if (reward != -1) {
+                    float value = reward + before_value(searchers[0], tmp, 2);
+                    if (value < worst_value) {
+                        worst_value = value;
+                        worst_pos = pos;
                     }
-                    after.add_tile();
                 }
-
-                // randomly choose one legal position
+            }
+        }
+        else {
+            int worst_hint = -1;
+            int& tile_bag = random.tile_bag;
+            int searched = 0;
+            after.add_tile();
+            // choose the worst hint tile to player
+            // the bag entries of a hint lead to the same boards, so only the first one of each hint is searched,
+            // the others could not be strictly worse
+            for (int t : bag) if (tile_bag & (1 << t)) {
+                if (searched & (1 << (t / 4))) continue;
+                searched |= 1 << (t / 4);
                 for (int pos : space) {
                     if(slide_op == 0 && pos < 12)       continue;
                     if(slide_op == 1 && pos % 4 != 0)   continue;
                     if(slide_op == 2 && pos > 3)        continue;
                     if(slide_op == 3 && pos % 4 != 3)   continue;
                     if (after(pos) != 0) continue;
-                    return action::place(pos, tile);
-                }
-            }
-            // for playing, choose the worst position and hint tile to minimize score
-            else {
-                float worst_value = FLT_MAX;
-                int worst_pos = -1;
-
-                // choose hint tile, with 1/21 probability to place bonus tile
-                if (after.can_place_bonus_tile() && popup(engine) == 0) {
-                    after.info(4);
-                    after.add_bonus_tile();
-                    after.add_tile();
-
-                    for (int pos : space) {
-                        if(slide_op == 0 && pos < 12)       continue;
-                        if(slide_op == 1 && pos % 4 != 0)   continue;
-                        if(slide_op == 2 && pos > 3)        continue;
-                        if(slide_op == 3 && pos % 4 != 3)   continue;
-                        if (after(pos) != 0) continue;
-
-                        board tmp = board(after);
-                        board::reward reward = tmp.place(pos, tile);
-                        if (reward != -1) {
-                            float value = reward + before_value(tmp, 2);
-                            if (value < worst_value) {
-                                worst_value = value;
-                                worst_pos = pos;
-                            }
-                        }
-                    }
-                }
-                else {
-                    int worst_hint = -1;
-                    after.add_tile();
-                    // choose the worst hint tile to player
-                    for (int t : bag) if (tile_bag & (1 << t)) {
-                        for (int pos : space) {
-                            if(slide_op == 0 && pos < 12)       continue;
-                            if(slide_op == 1 && pos % 4 != 0)   continue;
-                            if(slide_op == 2 && pos > 3)        continue;
-                            if(slide_op == 3 && pos % 4 != 3)   continue;
-                            if (after(pos) != 0) continue;
-
-                            board tmp = board(after);
-                            board::reward reward = tmp.place(pos, tile);
-                            tmp.info(t / 4 + 1);
-                            if (reward != -1) {
-                                float value = reward + before_value(tmp, 2);
-                                if (value < worst_value) {
-                                    worst_value = value;
-                                    worst_pos = pos;
-                                    worst_hint = t; // 0~11
-                                }
-                            }
+
+                    board tmp = board(after);
+                    board::reward reward = tmp.place(pos, tile);
+                    tmp.info(t / 4 + 1);
+                    if (reward != -1) {
+                        float value = reward + before_value(searchers[0], tmp, 2);
+                        if (value < worst_value) {
+                            worst_value = value;
+                            worst_pos = pos;
+                            worst_hint = t; // 0~11
                         }
                     }
-                    if (worst_hint != -1) {
-                        after.info(worst_hint / 4 + 1);
-                        tile_bag ^= (1 << worst_hint);
-                        if (tile_bag == 0)  tile_bag = (1 << 12) - 1;
-                    }
-                }
-
-                if (worst_pos != -1) {
-                    return action::place(worst_pos, tile);
                 }
             }
+            if (worst_hint != -1) {
+                after.info(worst_hint / 4 + 1);
+                tile_bag ^= (1 << worst_hint);
+                if (tile_bag == 0)  tile_bag = (1 << 12) - 1;
+            }
+        }
+
+        if (worst_pos != -1) {
+            return action::place(worst_pos, tile);
         }
         return action();
     }
@@ -456,6 +1409,6 @@ public:
 private:
     std::array<int, 16> space;
     std::array<int, 12> bag;
-    int tile_bag;
-    std::uniform_int_distribution<int> popup;
+    spawner random;
+    bool adversarial;
 };
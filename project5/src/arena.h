@@ -22,6 +22,10 @@ public:
             action move = who.take_action(state(), prev_action);
             return move;
         }
+        // let the player search ahead while the opponent takes its turn
+        void ponder(action move) {
+            play->ponder(state(), move);
+        }
         void open_episode(const std::string& tag) {
             play->open_episode(tag);
             evil->open_episode(tag);
@@ -73,6 +77,10 @@ public:
         return false;
     }
 
+    void stop_pondering() {
+        for (auto who : lounge) who.second->stop_pondering();
+    }
+
 public:
     bool register_agent(std::shared_ptr<agent> a) {
         // std::cout << lounge.size() << std::endl;
@@ -0,0 +1,130 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "xoshiro.h"
+
+/**
+ * N games of self-play against the random environment, held as structure of arrays
+ *
+ * a game is its packed tiles, hint, tile bag (bit t for the t-th of the 12 bag tiles), score,
+ * largest tile, and the counts of placed tiles and bonus tiles, so a step over all games walks flat arrays
+ * place() is the environment step and slide() the player step, each plays one turn of every game
+ * that is not over; the moves of a game are kept until reset(), e.g., to fill a statistic afterwards
+ * game i draws its placements from the i-th given stream, e.g., the placement stream of a trainenv with lane=i
+ */
+class batch {
+public:
+    enum result { playing = 0, player_won = 1, environment_won = 2 };
+
+public:
+    batch(const std::vector<xoshiro*>& streams) : batch(streams.size()) { rng = streams; }
+
+    size_t size() const { return tiles.size(); }
+
+    // start game i over, with an empty board and a full tile bag
+    void reset(size_t i) {
+        tiles[i] = 0;
+        hints[i] = 0;
+        bags[i] = (1 << 12) - 1;
+        scores[i] = 0;
+        largest[i] = 0;
+        placed[i] = 0;
+        bonus[i] = 0;
+        last[i] = -1;
+        steps[i] = 0;
+        over[i] = playing;
+        moves[i].clear();
+    }
+
+    board state(size_t i) const { return board::unpack(tiles[i], hints[i], placed[i], bonus[i]); }
+
+    /**
+     * the environment step: place tiles on every game until it is the player's turn
+     * (the 9 initial tiles of a new game, or one tile after a slide), as the random environment does
+     */
+    void place() {
+        for (size_t i = 0; i < size(); i++) {
+            while (over[i] == playing && (steps[i] < 9 || steps[i] % 2 == 0)) place(i);
+        }
+    }
+
+    /**
+     * the player step: slide every game that is not over
+     * all games are prepared before any is decided, so a 1-ply player prefetches the weights of all games at once
+     */
+    void slide(player& play) {
+        for (size_t i = 0; i < size(); i++) {
+            if (over[i] != playing) continue;
+            before[i] = state(i);
+            play.prepare(lanes[i], before[i]);
+        }
+        for (size_t i = 0; i < size(); i++) {
+            if (over[i] != playing) continue;
+            action move = play.decide(lanes[i], before[i]);
+            int op = move.event() & 0b11;
+            board::reward reward = move.type() == action::slide::type ? before[i].slide(op) : -1;
+            if (reward == -1) {
+                over[i] = environment_won;
+                continue;
+            }
+            tiles[i] = before[i].pack();
+            largest[i] = before[i].get_largest();
+            scores[i] += reward;
+            last[i] = op;
+            steps[i]++;
+            moves[i].push_back(move);
+        }
+    }
+
+public:
+    std::vector<board::data> tiles;
+    std::vector<board::cell> hints;
+    std::vector<int> bags;
+    std::vector<board::reward> scores;
+    std::vector<board::cell> largest;
+    std::vector<int> placed;
+    std::vector<int> bonus;
+    std::vector<int8_t> last; // the last slide op, -1 before the first slide
+    std::vector<uint32_t> steps;
+    std::vector<uint8_t> over;
+    std::vector<std::vector<action>> moves;
+    std::vector<player::game> lanes; // the search state of the player for each game
+
+private:
+    batch(size_t n) :
+        tiles(n), hints(n), bags(n), scores(n), largest(n), placed(n), bonus(n), last(n), steps(n), over(n),
+        moves(n), lanes(n), before(n), rng(n) {
+        for (size_t i = 0; i < n; i++) reset(i);
+    }
+
+    // place one tile on game i by the rules of spawner::place, on the packed tiles
+    void place(size_t i) {
+        action move = spawner::place(*rng[i], bags[i], hints[i], placed[i], bonus[i], largest[i], empty_mask(tiles[i]), last[i]);
+        if (move.type() != action::place::type) {
+            over[i] = player_won;
+            return;
+        }
+        action::place put(move);
+        board::cell tile = put.tile();
+        tiles[i] |= board::data(tile) << (put.position() * 4);
+        largest[i] = std::max(largest[i], tile);
+        scores[i] += board::score_of(tile);
+        steps[i]++;
+        moves[i].push_back(move);
+    }
+
+    // the empty cells of packed tiles as a bit mask, bit i for 1-d index i
+    static int empty_mask(board::data raw) {
+        board::data used = (raw | (raw >> 1) | (raw >> 2) | (raw >> 3)) & 0x1111111111111111ull;
+        int mask = 0;
+        for (int i = 0; i < 16; i++) mask |= int((used >> (i * 4)) & 1) << i;
+        return mask ^ 0xffff;
+    }
+
+private:
+    std::vector<board> before;
+    std::vector<xoshiro*> rng;
+};
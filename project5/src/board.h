@@ -1,5 +1,6 @@
 #pragma once
 #include <array>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include "utilities.h"
@@ -24,7 +25,9 @@ public:
 
 public:
     board() : tile(), attr(0), largest_tile(0), num_tile(0), num_bonus_tile(0) {}
-    board(const grid& b, data v = 0) : tile(b), attr(v) {}
+    board(const grid& b, data v = 0) : tile(b), attr(v), largest_tile(0), num_tile(0), num_bonus_tile(0) {
+        for (auto& row : tile) for (auto t : row) largest_tile = std::max(largest_tile, t);
+    }
     board(const board& b) = default;
     board& operator =(const board& b) = default;
 
@@ -38,11 +41,65 @@ public:
     data info() const { return attr; }
     data info(data dat) { data old = attr; attr = dat; return old; }
     cell get_largest() const { return largest_tile; }
+    cell get_bonus_count() const { return num_bonus_tile; }
+    cell get_tile_count() const { return num_tile; }
+    /**
+     * return the empty cells as a bit mask, bit i for 1-d index i
+     */
+    int empty_mask() const {
+        int mask = 0;
+        for (int i = 0; i < 16; i++) mask |= (operator()(i) == 0) << i;
+        return mask;
+    }
     void add_tile() { num_tile++; }
     void add_bonus_tile() { num_bonus_tile++; }
-    bool can_place_bonus_tile() const {
-        return largest_tile >= 7 &&
-               num_tile + 1 >= (num_bonus_tile + 1) * 21;
+    bool can_place_bonus_tile() const { return can_place_bonus_tile(largest_tile, num_tile, num_bonus_tile); }
+    // the same rule on the largest tile and the tile counters alone, e.g., for games kept as packed tiles
+    static bool can_place_bonus_tile(cell largest, int tiles, int bonus_tiles) {
+        return largest >= 7 &&
+               tiles + 1 >= (bonus_tiles + 1) * 21;
+    }
+
+public:
+    /**
+     * pack the tiles into 64 bits, 4 bits per tile in 1-d index order (tile 0 in the lowest bits)
+     */
+    data pack() const {
+        data raw = 0;
+        for (int i = 15; i >= 0; i--) raw = (raw << 4) | (operator()(i) & 0x0f);
+        return raw;
+    }
+    /**
+     * build a board from packed tiles and a hint, and the counts of placed tiles and bonus tiles
+     */
+    static board unpack(data raw, data hint = 0, int tiles = 0, int bonus_tiles = 0) {
+        grid g;
+        for (int i = 0; i < 16; i++, raw >>= 4) g[i / 4][i % 4] = raw & 0x0f;
+        board b(g, hint);
+        b.num_tile = tiles;
+        b.num_bonus_tile = bonus_tiles;
+        return b;
+    }
+
+public:
+    /**
+     * what a place changes besides its cell: the hint and the tile counters
+     * a search saves it, places a tile, and takes the tile back with unplace() instead of copying the board
+     */
+    struct undo {
+        data attr;
+        int num_tile;
+        int num_bonus_tile;
+    };
+    undo save() const { return { attr, num_tile, num_bonus_tile }; }
+    void restore(const undo& u) {
+        attr = u.attr;
+        num_tile = u.num_tile;
+        num_bonus_tile = u.num_bonus_tile;
+    }
+    void unplace(unsigned pos, const undo& u) {
+        operator()(pos) = 0;
+        restore(u);
     }
 
 public:
@@ -63,8 +120,10 @@ public:
         if (pos >= 16) return -1;
         if (operator()(pos) != 0)   return -1;
         operator()(pos) = tile;
-        return tile >= 3 ? power(3, tile - 2) : 0;
+        return score_of(tile);
     }
+    // the score of placing a tile
+    static reward score_of(cell tile) { return tile >= 3 ? power(3, tile - 2) : 0; }
 
     /**
      * apply slide to the board
@@ -80,50 +139,46 @@ public:
         }
     }
 
-    reward slide_left() {
-        board prev = *this;
+    reward slide_left() { return slide_lines(0, 1, 4); }
+    reward slide_right() { return slide_lines(3, -1, 4); }
+    reward slide_up() { return slide_lines(0, 4, 1); }
+    reward slide_down() { return slide_lines(12, -4, 1); }
+
+    /**
+     * slide the 4 lines toward their first cells, in place and without rotating the board
+     * line i starts from cell first + i * next, and its cells are step apart
+     */
+    reward slide_lines(int first, int step, int next) {
         reward score = 0;
+        bool moved = false;
         for (int r = 0; r < 4; r++) {
-            auto& row = tile[r];
+            int line = first + r * next;
             for (int c = 1; c < 4; c++) {
-                int tile = row[c], hold = row[c-1];
+                cell& from = operator()(line + c * step);
+                cell& hold = operator()(line + (c - 1) * step);
+                int tile = from;
                 if (tile == 0) continue;
                 if (hold) {
-                    if (tile > 2 && tile == hold) {
+                    if (tile > 2 && tile == int(hold)) {
                         score += power(3, tile - 2);
-                        row[c-1] = ++tile;
-                        row[c] = 0;
-                        largest_tile = std::max(largest_tile, cell(row[c-1]));
+                        hold = ++tile;
+                        from = 0;
+                        largest_tile = std::max(largest_tile, hold);
+                        moved = true;
                     } else if (tile + hold == 3) {
                         score += 3;
-                        row[c-1] = 3;
-                        row[c] = 0;
+                        hold = 3;
+                        from = 0;
+                        moved = true;
                     }
                 } else {
-                    row[c-1] = tile;
-                    row[c] = 0;
+                    hold = tile;
+                    from = 0;
+                    moved = true;
                 }
             }
         }
-        return (*this != prev) ? score : -1;
-    }
-    reward slide_right() {
-        reflect_horizontal();
-        reward score = slide_left();
-        reflect_horizontal();
-        return score;
-    }
-    reward slide_up() {
-        rotate_right();
-        reward score = slide_right();
-        rotate_left();
-        return score;
-    }
-    reward slide_down() {
-        rotate_right();
-        reward score = slide_left();
-        rotate_left();
-        return score;
+        return moved ? score : -1;
     }
 
     void transpose() {
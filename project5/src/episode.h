@@ -6,6 +6,7 @@
 #include <sstream>
 #include <chrono>
 #include <numeric>
+#include <limits>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
@@ -18,9 +19,24 @@ public:
     episode() : 
         ep_state(initial_state()), 
         ep_score(0), 
-        ep_time(0)
+        ep_time(0),
+        ep_slide_time(0),
+        ep_place_time(0)
         { ep_moves.reserve(10000); }
 
+public:
+    // start over as an empty episode, the move buffer keeps its capacity
+    void clear() {
+        ep_state = initial_state();
+        ep_score = 0;
+        ep_moves.clear();
+        ep_time = 0;
+        ep_slide_time = 0;
+        ep_place_time = 0;
+        ep_open = {};
+        ep_close = {};
+    }
+
 public:
     board& state() { return ep_state; }
     const board& state() const { return ep_state; }
@@ -28,16 +44,30 @@ public:
     void open_episode(const std::string& tag) {
         ep_open = { tag, millisec() };
     }
+    /**
+     * open an episode that was played elsewhere and took the given time, e.g., a game of a batch that is replayed when it is over
+     */
+    void open_episode(const std::string& tag, time_t time) {
+        ep_open = { tag, millisec() - time };
+    }
     void close_episode(const std::string& tag) {
         ep_close = { tag, millisec() };
     }
     bool apply_action(action move) {
         board::reward reward = move.apply(state());
         if (reward == -1) return false;
-        ep_moves.emplace_back(move, reward, millisec() - ep_time);
+        ep_moves.emplace_back(move);
         ep_score += reward;
+        (move.type() == action::slide::type ? ep_slide_time : ep_place_time) += millisec() - ep_time;
         return true;
     }
+    /**
+     * append a move that was played elsewhere, e.g., by a batch of games, with the time it took
+     */
+    bool replay_action(action move, time_t time = 0) {
+        ep_time = millisec() - time;
+        return apply_action(move);
+    }
     agent& take_turns(agent& play, agent& evil) {
         ep_time = millisec();
         return (std::max(step() + 1, size_t(9)) % 2) ? evil : play;
@@ -57,22 +87,11 @@ public:
     }
 
     time_t time(unsigned who = -1u) const {
-        time_t time = 0;
-        size_t i = 9;
         switch (who) {
-        case action::place::type: {
-            for (i = 0; i < ep_moves.size() && i < 8; i++) time += ep_moves[i].time;
-            i = 8;
-            // no break;
+        case action::slide::type: return ep_slide_time;
+        case action::place::type: return ep_place_time;
+        default:                  return ep_close.when - ep_open.when;
         }
-        case action::slide::type:
-            while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
-            break;
-        default:
-            time = ep_close.when - ep_open.when;
-            break;
-        }
-        return time;
     }
 
     std::vector<action> actions(unsigned who = -1u) const {
@@ -98,7 +117,14 @@ public:
 
     friend std::ostream& operator <<(std::ostream& out, const episode& ep) {
         out << ep.ep_open << '|';
-        for (const move& mv : ep.ep_moves) out << mv;
+        // the time of each role is written after its last move, so a reader that sums the times by role gets the same
+        size_t last_slide = ep.ep_moves.size(), last_place = ep.ep_moves.size();
+        for (size_t i = 0; i < ep.ep_moves.size(); i++) (ep.ep_moves[i].is_slide() ? last_slide : last_place) = i;
+        for (size_t i = 0; i < ep.ep_moves.size(); i++) {
+            out << action(ep.ep_moves[i]);
+            time_t time = i == last_slide ? ep.ep_slide_time : i == last_place ? ep.ep_place_time : 0;
+            if (time) out << '(' << std::dec << time << ')';
+        }
         out << '|' << ep.ep_close;
         return out;
     }
@@ -109,9 +135,19 @@ public:
         std::stringstream(token) >> ep.ep_open;
         std::getline(in, token, '|');
         for (std::stringstream moves(token); !moves.eof(); moves.peek()) {
-            ep.ep_moves.emplace_back();
-            moves >> ep.ep_moves.back();
-            ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+            action code;
+            moves >> code;
+            // the reward is recomputed by the replay, and the times are summed by role
+            if (moves.peek() == '[') moves.ignore(std::numeric_limits<std::streamsize>::max(), ']');
+            time_t time = 0;
+            if (moves.peek() == '(') {
+                moves.ignore(1);
+                moves >> std::dec >> time;
+                moves.ignore(1);
+            }
+            ep.ep_moves.emplace_back(code);
+            ep.ep_score += code.apply(ep.ep_state);
+            (ep.ep_moves.back().is_slide() ? ep.ep_slide_time : ep.ep_place_time) += time;
         }
         std::getline(in, token, '|');
         std::stringstream(token) >> ep.ep_close;
@@ -120,34 +156,26 @@ public:
 
 protected:
 
+    /**
+     * a move in 16 bits: a slide is 0x8000 | op, a placement is pos | tile << 4, and 0xffff is an invalid action
+     * its reward is not kept, since replaying the moves from the initial state gives it again
+     */
     struct move {
-        action code;
-        board::reward reward;
-        time_t time;
-        move(action code = {}, board::reward reward = 0, time_t time = 0) : code(code), reward(reward), time(time) {}
-
-        operator action() const { return code; }
-        friend std::ostream& operator <<(std::ostream& out, const move& m) {
-            out << m.code;
-            if (m.reward) out << '[' << std::dec << m.reward << ']';
-            if (m.time) out << '(' << std::dec << m.time << ')';
-            return out;
+        uint16_t code;
+        move(action a = {}) : code(encode(a)) {}
+
+        bool is_slide() const { return code != invalid && (code & 0x8000); }
+        operator action() const {
+            if (code == invalid) return action();
+            if (is_slide()) return action::slide(code & 0b11);
+            return action::place(code & 0x0f, code >> 4);
         }
-        friend std::istream& operator >>(std::istream& in, move& m) {
-            in >> m.code;
-            m.reward = 0;
-            m.time = 0;
-            if (in.peek() == '[') {
-                in.ignore(1);
-                in >> std::dec >> m.reward;
-                in.ignore(1);
-            }
-            if (in.peek() == '(') {
-                in.ignore(1);
-                in >> std::dec >> m.time;
-                in.ignore(1);
-            }
-            return in;
+
+        static const uint16_t invalid = 0xffff;
+        static uint16_t encode(action a) {
+            if (a.type() == action::slide::type) return 0x8000 | (a.event() & 0b11);
+            if (a.type() == action::place::type) return a.event() & 0x3ff;
+            return invalid;
         }
     };
 
@@ -177,6 +205,8 @@ private:
     board::reward ep_score;
     std::vector<move> ep_moves;
     time_t ep_time;
+    time_t ep_slide_time;
+    time_t ep_place_time;
 
     meta ep_open;
     meta ep_close;
@@ -0,0 +1,128 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+/**
+ * persistent work-stealing thread pool for parallel search
+ *
+ * every worker owns a deque of tasks, worker 0 is the thread that calls into the pool
+ * spawn() pushes a task to the back of the caller's deque, and wait() runs tasks until a group is finished:
+ * first from the back of its own deque, then stolen from the front of the others
+ * idle pool threads steal in the same way, and sleep while all deques are empty
+ */
+class pool {
+public:
+    typedef std::function<void(size_t)> task_type;
+    typedef std::function<void(size_t, size_t)> job_type;
+
+    // a set of spawned tasks to wait for
+    struct group {
+        std::atomic<size_t> pending;
+        group() : pending(0) {}
+    };
+
+public:
+    pool(size_t threads) : lanes(threads), queued(0), stop(false) {
+        for (size_t i = 1; i < threads; i++) helpers.emplace_back(&pool::work, this, i);
+    }
+    ~pool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : helpers) t.join();
+    }
+    pool(const pool&) = delete;
+    pool& operator =(const pool&) = delete;
+
+    size_t size() const { return lanes.size(); }
+
+    /**
+     * push a task of the group to the deque of the given worker
+     */
+    void spawn(group& g, const task_type& todo, size_t worker) {
+        g.pending++;
+        queued++;
+        {
+            std::lock_guard<std::mutex> lock(lanes[worker].mtx);
+            lanes[worker].tasks.push_back({ todo, &g });
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        wake.notify_one();
+    }
+
+    /**
+     * run tasks on the given worker until all tasks of the group are finished
+     */
+    void wait(group& g, size_t worker) {
+        while (g.pending) {
+            if (!execute(worker)) std::this_thread::yield();
+        }
+    }
+
+    /**
+     * call job(task, worker) for all tasks in parallel, from worker 0
+     */
+    void run(size_t tasks, const job_type& job) {
+        group g;
+        for (size_t i = 0; i < tasks; i++) spawn(g, [&job, i](size_t worker) { job(i, worker); }, 0);
+        wait(g, 0);
+    }
+
+private:
+    struct task {
+        task_type todo;
+        group* owner;
+    };
+    struct lane {
+        std::mutex mtx;
+        std::deque<task> tasks;
+    };
+
+    // run one task from the own deque, or a stolen one, return false if there is none
+    bool execute(size_t worker) {
+        task t;
+        bool found = false;
+        for (size_t k = 0; k < lanes.size() && !found; k++) {
+            lane& from = lanes[(worker + k) % lanes.size()];
+            std::lock_guard<std::mutex> lock(from.mtx);
+            if (from.tasks.empty()) continue;
+            if (k == 0) {
+                t = std::move(from.tasks.back());
+                from.tasks.pop_back();
+            } else {
+                t = std::move(from.tasks.front());
+                from.tasks.pop_front();
+            }
+            found = true;
+        }
+        if (!found) return false;
+        queued--;
+        t.todo(worker);
+        t.owner->pending--;
+        return true;
+    }
+
+    void work(size_t worker) {
+        while (true) {
+            if (execute(worker)) continue;
+            std::unique_lock<std::mutex> lock(mtx);
+            wake.wait(lock, [&]() { return stop || queued > 0; });
+            if (stop) return;
+        }
+    }
+
+private:
+    std::vector<lane> lanes;
+    std::vector<std::thread> helpers;
+    std::atomic<size_t> queued;
+    bool stop;
+    std::mutex mtx;
+    std::condition_variable wake;
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <vector>
+#include <random>
+#include "board.h"
+
+/**
+ * fixed-capacity ring of after-states for experience replay
+ *
+ * each after-state takes 16 bytes: the packed tiles, its hint, its bonus tile count (for stage=bonus),
+ * the reward of the slide that produced it, and whether it is the last after-state of its episode
+ * whole episodes are pushed at once, so the successor of a stored state is always the next slot
+ */
+class replay {
+public:
+    struct transition {
+        board::data tiles;
+        board::reward reward;
+        uint8_t hint;
+        uint8_t last;
+        uint16_t bonus;
+        transition(const board& b = {}, board::reward reward = 0, bool last = false) :
+            tiles(b.pack()), reward(reward), hint(b.info()), last(last), bonus(b.get_bonus_count()) {}
+        board state() const { return board::unpack(tiles, hint, 0, bonus); }
+    };
+
+public:
+    replay(size_t capacity = 0) : ring(capacity), head(0), used(0) {}
+
+    size_t capacity() const { return ring.size(); }
+    size_t size() const { return used; }
+
+    void push(const board& b, board::reward reward, bool last) {
+        ring[head] = transition(b, reward, last);
+        head = (head + 1) % ring.size();
+        used = std::min(used + 1, ring.size());
+    }
+
+    const transition& at(size_t i) const { return ring[i]; }
+    const transition& next(size_t i) const { return ring[(i + 1) % ring.size()]; }
+
+    /**
+     * draw n stored positions uniformly into batch (as slot indices)
+     */
+    template<typename engine_type>
+    void sample(size_t n, engine_type& engine, std::vector<size_t>& batch) const {
+        batch.clear();
+        if (used == 0) return;
+        size_t oldest = (head + ring.size() - used) % ring.size();
+        std::uniform_int_distribution<size_t> pick(0, used - 1);
+        for (size_t i = 0; i < n; i++) batch.push_back((oldest + pick(engine)) % ring.size());
+    }
+
+private:
+    std::vector<transition> ring;
+    size_t head;
+    size_t used;
+};
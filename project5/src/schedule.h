@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+/**
+ * learning rate schedule, evaluated on the number of finished episodes n
+ *
+ * const:   alpha
+ * step:    alpha * decay ^ floor(n / period)
+ * exp:     alpha * decay ^ (n / period)
+ * cosine:  min + (alpha - min) * (1 + cos(pi * n / period)) / 2, then held at min
+ * plateau: the rate is multiplied by decay once the block average has not improved
+ *          for 'patience' blocks in a row, checked by end_block() whenever a block finishes
+ *
+ * the rate never drops below min
+ */
+class schedule {
+public:
+    schedule(const std::string& type = "const", float alpha = 0.003125f, float decay = 0.75f,
+             size_t period = 250000, float min = 0.0f, size_t patience = 1) :
+        type(type), alpha(alpha), decay(decay), period(std::max(period, size_t(1))), min(min), patience(patience),
+        rate(alpha), best(0), stale(0) {}
+
+public:
+    /**
+     * return the learning rate after n episodes, n may skip values, e.g., when episodes finish in chunks
+     */
+    float operator()(size_t n) {
+        if (type == "step") {
+            rate = alpha * std::pow(decay, float(n / period));
+        } else if (type == "exp") {
+            rate = alpha * std::pow(decay, float(n) / period);
+        } else if (type == "cosine") {
+            double progress = std::min(double(n) / period, 1.0);
+            rate = min + (alpha - min) * float(1 + std::cos(M_PI * progress)) / 2;
+        }
+        return rate = std::max(rate, min);
+    }
+
+    /**
+     * return the learning rate after a block has finished with the given average score
+     */
+    float end_block(double average) {
+        if (type == "plateau") {
+            if (average > best) {
+                best = average;
+                stale = 0;
+            } else if (++stale >= patience) {
+                rate *= decay;
+                stale = 0;
+            }
+        }
+        return rate = std::max(rate, min);
+    }
+
+    float current() const { return rate; }
+
+private:
+    std::string type;
+    float alpha;
+    float decay;
+    size_t period;
+    float min;
+    size_t patience;
+
+    float rate;
+    double best;
+    size_t stale;
+};
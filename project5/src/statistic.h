@@ -21,7 +21,8 @@ public:
         : total(total),
           block(block ? block : total),
           limit(limit ? limit : total),
-          count(0) {}
+          count(0),
+          block_avg(0) {}
 
 public:
     /**
@@ -101,19 +102,41 @@ public:
         return count >= total;
     }
 
+    /**
+     * once 'limit' records are kept, the oldest record is recycled as the new one,
+     * so its list node and move buffer are reused instead of allocated again
+     */
     void open_episode(const std::string& flag = "") {
-        if (count++ >= limit) data.pop_front();
-        data.emplace_back();
+        if (count++ >= limit && data.size()) {
+            data.splice(data.end(), data, data.begin());
+            data.back().clear();
+        } else {
+            data.emplace_back();
+        }
         data.back().open_episode(flag);
     }
 
     void close_episode(const std::string& flag = "") {
         data.back().close_episode(flag);
-        if (count % block == 0) show();
+        if (count % block == 0) {
+            size_t blk = std::min(data.size(), block);
+            double sum = 0;
+            auto it = data.end();
+            for (size_t i = 0; i < blk; i++) sum += (--it)->score();
+            block_avg = sum / blk;
+            show();
+        }
         // if (count % 10000 == 0) show();
     }
 
     int episode_count() { return count; }
+    size_t total_episodes() const { return total; }
+
+    /**
+     * the average score of the last finished block, and whether the last episode finished a block
+     */
+    double average() const { return block_avg; }
+    bool block_finished() const { return count && count % block == 0; }
 
     episode& at(size_t i) {
         auto it = data.begin();
@@ -146,5 +169,6 @@ private:
     size_t block;
     size_t limit;
     size_t count;
+    double block_avg;
     std::list<episode> data;
 };
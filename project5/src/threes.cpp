@@ -1,6 +1,6 @@
 /**
  * Basic Environment for Game threes
- * use 'g++ -std=c++11 -O3 -g -Wall -fmessage-length=0 -o threes threes.cpp' to compile the source
+ * use 'g++ -std=c++11 -O3 -g -Wall -fmessage-length=0 -pthread -o threes threes.cpp' to compile the source
  *
  * Github Repository URL
  * https://github.com/lcd78706/Threes-AI/
@@ -15,6 +15,10 @@
 #include <string>
 #include <regex>
 #include <memory>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
@@ -22,6 +26,7 @@
 #include "statistic.h"
 #include "arena.h"
 #include "io.h" 
+#include "batch.h"
 
 int shell(int argc, const char* argv[]) {
     arena host("anonymous");
@@ -51,6 +56,7 @@ int shell(int argc, const char* argv[]) {
     for (std::string command; input() >> command; ) {
         try {
             if (std::regex_match(command, match_move)) {
+                host.stop_pondering();
                 std::string id, move;
                 std::stringstream(command) >> id >> move;
 
@@ -66,6 +72,7 @@ int shell(int argc, const char* argv[]) {
                     }
                     else {
                         output() << id << ' ' << a << std::endl;
+                        host.at(id).ponder(a);
                     }
                 } else {
                     // perform your opponent's action
@@ -81,6 +88,7 @@ int shell(int argc, const char* argv[]) {
                 }
 
             } else if (std::regex_match(command, match_ctrl)) {
+                host.stop_pondering();
                 std::string id, ctrl, tag;
                 std::stringstream(command) >> id >> ctrl >> tag;
 
@@ -97,6 +105,7 @@ int shell(int argc, const char* argv[]) {
                 }
 
             } else if (std::regex_match(command, arena_ctrl)) {
+                host.stop_pondering(); // e.g., status reads the search counters of the agents
                 std::string ctrl;
                 std::stringstream(command).ignore(1) >> ctrl;
 
@@ -117,6 +126,9 @@ int shell(int argc, const char* argv[]) {
                         info() << " " << who->name() << "(" << who->role() << ")";
                     }
                     info() << std::endl;
+                    for (auto who : host.list_agents()) {
+                        info() << who->search_summary() << std::endl;
+                    }
                     info() << "match: " << host.list_matches().size() << std::endl;
                     for (auto ep : host.list_matches()) {
                         info() << ep->name() << " " << (*ep) << std::endl;
@@ -143,6 +155,161 @@ int shell(int argc, const char* argv[]) {
     return 0;
 }
 
+/**
+ * train the player from recorded episodes, e.g., a statistic file or an arena dump file
+ * the file is read in chunks of lines, each chunk is parsed and replayed by all threads,
+ * while the main thread reads the next chunk
+ */
+int train_from(std::istream& in, player& play, size_t threads, size_t block) {
+    auto read_chunk = [&](std::vector<std::string>& chunk) {
+        chunk.clear();
+        for (std::string line; chunk.size() < threads * 256 && std::getline(in, line); )
+            if (line.size()) chunk.push_back(line);
+    };
+
+    std::vector<std::string> chunk, next;
+    std::vector<board::reward> score;
+    size_t count = 0, shown = 0;
+    int64_t sum = 0; // the scores of a large block overflow an int
+    for (read_chunk(chunk); chunk.size(); chunk.swap(next)) {
+        score.assign(chunk.size(), 0);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (size_t i = t; i < chunk.size(); i += threads) {
+                    episode ep;
+                    std::stringstream(chunk[i]) >> ep;
+                    play.learn_from(ep.actions());
+                    score[i] = ep.score();
+                }
+            });
+        }
+        read_chunk(next);
+        for (std::thread& worker : workers) worker.join();
+
+        for (board::reward s : score) sum += s;
+        count += chunk.size();
+        if (count - shown >= block) {
+            std::cout << count << "\t" << "avg = " << (sum / (count - shown)) << std::endl;
+            play.adjust_learning_rate(count);
+            play.end_block(double(sum) / (count - shown));
+            shown = count;
+            sum = 0;
+        } else {
+            play.adjust_learning_rate(count);
+        }
+    }
+    return 0;
+}
+
+/**
+ * self-play until the statistic is finished, with the player against the given environment
+ * the environment is called through its own type, so the placements of trainenv are not virtual calls
+ */
+template<class environment>
+void play_games(statistic& stat, player& play, environment& evil) {
+    while (!stat.is_finished()) {
+        play.open_episode("~:" + evil.name());
+        evil.open_episode(play.name() + ":~");
+        stat.open_episode(play.name() + ":" + evil.name());
+
+        episode& game = stat.back();
+        action prev = action::place(0, 0);
+
+        while (true) {
+            agent& who = game.take_turns(play, evil);
+            action move = (&who == &play) ? play.take_action(game.state(), prev) : evil.take_action(game.state(), prev);
+            prev = action(move);
+
+            if (game.apply_action(move) != true) break;
+            if (who.check_for_win(game.state())) break;
+        }
+        agent& win = game.last_turns(play, evil);
+
+        stat.close_episode(win.name());
+        play.close_episode(win.name());
+        evil.close_episode(win.name());
+        play.adjust_learning_rate(stat.episode_count());
+        if (stat.block_finished()) play.end_block(stat.average());
+    }
+}
+
+/**
+ * self-play of N games through the batch API, for --batch=N against the random environment
+ * every round places the tiles of all games with one call and slides all games with another,
+ * a finished game is replayed into the statistic, and its slot starts the next game of the slot
+ * slot i plays the games i, i+N, i+2N, ..., so a run split with streams= plays the same games when N divides the totals
+ * the time of a step is shared evenly by the games it moved, and is replayed with their first move of each role
+ * in whole milliseconds, the remainder is carried to the next game of the slot
+ * the duration of a replayed game is the sum of its shares, so the ops of the statistic count the games as if sequential
+ */
+void play_batched(statistic& stat, player& play, const std::string& evil_args, size_t n) {
+    // game i draws from the placement stream of lane i, which is checkpointed with streams= as usual
+    std::vector<std::unique_ptr<trainenv>> envs;
+    std::vector<xoshiro*> streams;
+    for (size_t i = 0; i < n; i++) {
+        envs.emplace_back(new trainenv(evil_args + " lane=" + std::to_string(i)));
+        streams.push_back(&envs.back()->placements());
+    }
+    batch games(streams);
+    std::vector<episode> records(n);
+    std::vector<bool> running(n, false), sliding(n, false);
+    std::vector<double> place_time(n), slide_time(n); // in milliseconds
+    size_t playing = 0, todo = stat.total_episodes() - stat.episode_count();
+    std::vector<size_t> next(n); // the next game of each slot
+    for (size_t i = 0; i < n; i++) next[i] = i;
+
+    // add the share of each moved game in the time since the step began
+    auto share = [&](std::vector<double>& time, const std::vector<bool>& moved, std::chrono::steady_clock::time_point began) {
+        std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - began;
+        size_t count = std::count(moved.begin(), moved.end(), true);
+        for (size_t i = 0; i < n; i++) if (moved[i]) time[i] += spent.count() / count;
+    };
+
+    auto start = [&](size_t i) {
+        if (next[i] >= todo) return;
+        next[i] += n;
+        games.reset(i);
+        play.begin_game(games.lanes[i]);
+        records[i].clear();
+        running[i] = true;
+        playing++;
+    };
+    for (size_t i = 0; i < n; i++) start(i);
+
+    while (playing) {
+        auto began = std::chrono::steady_clock::now();
+        games.place();
+        share(place_time, running, began);
+        for (size_t i = 0; i < n; i++) sliding[i] = running[i] && games.over[i] == batch::playing;
+        began = std::chrono::steady_clock::now();
+        games.slide(play);
+        share(slide_time, sliding, began);
+        for (size_t i = 0; i < n; i++) {
+            if (!running[i] || games.over[i] == batch::playing) continue;
+            time_t place_ms = std::floor(place_time[i]), slide_ms = std::floor(slide_time[i]);
+            place_time[i] -= place_ms;
+            slide_time[i] -= slide_ms;
+            // the episode spans the time of its moves, not the time its slot was busy with the other games
+            records[i].open_episode(play.name() + ":random", place_ms + slide_ms);
+            for (action move : games.moves[i]) {
+                time_t& time = move.type() == action::slide::type ? slide_ms : place_ms;
+                records[i].replay_action(move, time);
+                time = 0;
+            }
+            stat.open_episode(play.name() + ":random");
+            std::swap(stat.back(), records[i]);
+            stat.close_episode(games.over[i] == batch::player_won ? play.name() : "random");
+            play.end_game(games.lanes[i]);
+            play.adjust_learning_rate(stat.episode_count());
+            if (stat.block_finished()) play.end_block(stat.average());
+            running[i] = false;
+            playing--;
+            start(i);
+        }
+    }
+}
+
 int main(int argc, const char* argv[]) {
     std::cout << "Threes-Demo: ";
     std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
@@ -150,7 +317,9 @@ int main(int argc, const char* argv[]) {
 
     size_t total = 1000, block = 0, limit = 0;
     std::string play_args, evil_args;
-    std::string load, save;
+    std::string load, save, train;
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t batched = 0;
     bool summary = false;
     for (int i = 1; i < argc; i++) {
         std::string para(argv[i]);
@@ -168,6 +337,12 @@ int main(int argc, const char* argv[]) {
             load = para.substr(para.find("=") + 1);
         } else if (para.find("--save=") == 0) {
             save = para.substr(para.find("=") + 1);
+        } else if (para.find("--train-from=") == 0) {
+            train = para.substr(para.find("=") + 1);
+        } else if (para.find("--threads=") == 0) {
+            threads = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+        } else if (para.find("--batch=") == 0) {
+            batched = std::stoull(para.substr(para.find("=") + 1));
         } else if (para.find("--summary") == 0) {
             summary = true;
         } else if (para.find("--shell") == 0) {
@@ -175,6 +350,17 @@ int main(int argc, const char* argv[]) {
         }
     }
 
+    if (train.size()) {
+        // open the file before the player, whose save= would otherwise write untrained weights
+        std::ifstream in(train, std::ios::in);
+        if (!in.is_open()) {
+            info() << "cannot open " << train << std::endl;
+            return -1;
+        }
+        player play(play_args);
+        return train_from(in, play, threads, block ? block : 1000);
+    }
+
     statistic stat(total, block, limit);
 
     if (load.size()) {
@@ -185,38 +371,21 @@ int main(int argc, const char* argv[]) {
     }
 
     player play(play_args);
-    rndenv evil(evil_args);
-
-    while (!stat.is_finished()) {
-        // if (stat.episode_count() % 250000 == 0 &&
-        //     stat.episode_count() >= 250000 &&
-        //     stat.episode_count() <= 1000000)
-        //     play.reduce_learning_rate();
-
-        play.open_episode("~:" + evil.name());
-        evil.open_episode(play.name() + ":~");
-        stat.open_episode(play.name() + ":" + evil.name());
-
-        episode& game = stat.back();
-        action prev = action::place(0, 0);
-
-        while (true) {
-            agent& who = game.take_turns(play, evil);
-            action move = who.take_action(game.state(), prev);
-            prev = action(move);
-
-            if (game.apply_action(move) != true) break;
-            if (who.check_for_win(game.state())) break;
-        }
-        agent& win = game.last_turns(play, evil);
-
-        stat.close_episode(win.name());
-        play.close_episode(win.name());
-        evil.close_episode(win.name());
+    if (batched && !trainenv::suits(evil_args))
+        info() << "--batch needs the random environment, the games are played one at a time" << std::endl;
+    if (batched && trainenv::suits(evil_args)) {
+        play_batched(stat, play, evil_args, batched);
+    } else if (trainenv::suits(evil_args)) {
+        trainenv evil(evil_args);
+        play_games(stat, play, evil);
+    } else {
+        rndenv evil(evil_args);
+        play_games(stat, play, evil);
     }
 
     if (summary) {
         stat.summary();
+        std::cout << play.search_summary() << std::endl;
     }
 
     if (save.size()) {
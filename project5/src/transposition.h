@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include "board.h"
+
+/**
+ * fixed-size lock-free transposition table for the expectimax search
+ *
+ * a position is keyed by its packed tiles, hint, node type (after a slide op, or before a slide) and depth
+ * each bucket holds two entries: the first keeps the deepest search, the second is always replaced
+ * an entry stores (key ^ data, data), so a torn write from another thread fails the key check
+ *
+ * the table is kept between moves, age() starts the search of a new move:
+ * the deep entry of an older move may then be replaced by any search, and hits on it are counted as reused
+ * the counts are kept by the caller, one set per search thread, so the threads share no counter
+ */
+class transposition {
+public:
+    enum node { after_up = 0, after_right = 1, after_down = 2, after_left = 3, before = 4 };
+    enum bound { exact = 0, lower = 1, upper = 2 };
+
+    struct result {
+        float value;
+        int depth;
+        int best; // the best slide op of a before node, or -1
+        int type; // whether the value is exact, or a lower or upper bound from a pruned search
+    };
+
+    struct counters {
+        size_t probes;
+        size_t hits;
+        size_t reused;
+        size_t stores;
+        counters() : probes(0), hits(0), reused(0), stores(0) {}
+        counters& operator +=(const counters& c) {
+            probes += c.probes;
+            hits += c.hits;
+            reused += c.reused;
+            stores += c.stores;
+            return *this;
+        }
+
+        friend std::ostream& operator <<(std::ostream& out, const counters& c) {
+            std::ios ff(nullptr);
+            ff.copyfmt(out);
+            out << std::fixed << std::setprecision(1);
+            out << "tt: probes = " << c.probes << ", hits = " << c.hits;
+            out << " (" << (c.probes ? c.hits * 100.0 / c.probes : 0.0) << "%)";
+            out << ", reused = " << c.reused;
+            out << ", stores = " << c.stores;
+            out.copyfmt(ff);
+            return out;
+        }
+    };
+
+public:
+    transposition(unsigned bits = 20) : table(size_t(2) << bits), mask((size_t(1) << bits) - 1), generation(0) {}
+
+    static uint64_t hash(const board& b, int type, int depth) {
+        uint64_t h = b.pack() ^ (b.info() * 0x9e3779b97f4a7c15ull) ^ (uint64_t(type * 64 + depth) * 0xc2b2ae3d27d4eb4full);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    bool find(uint64_t key, result& res, counters& count) {
+        count.probes++;
+        entry* bucket = &table[(key & mask) << 1];
+        for (int i = 0; i < 2; i++) {
+            uint64_t data = bucket[i].data.load(std::memory_order_relaxed);
+            uint64_t check = bucket[i].check.load(std::memory_order_relaxed);
+            if ((check ^ data) == key && data) {
+                count.hits++;
+                if (age_of(data) != generation) count.reused++;
+                res = unpack(data);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void store(uint64_t key, float value, int depth, int best, int type, counters& count) {
+        count.stores++;
+        entry* bucket = &table[(key & mask) << 1];
+        uint64_t data = pack(value, depth, best, type) | (uint64_t(generation) << 45);
+        // replace the deep slot only with a search at least as deep or of an older move, otherwise use the other slot
+        uint64_t deep = bucket[0].data.load(std::memory_order_relaxed);
+        entry& slot = (deep == 0 || age_of(deep) != generation || unpack(deep).depth <= depth) ? bucket[0] : bucket[1];
+        slot.check.store(key ^ data, std::memory_order_relaxed);
+        slot.data.store(data, std::memory_order_relaxed);
+    }
+
+    void age() { generation = (generation + 1) & 0x3f; }
+
+    void clear() {
+        for (entry& e : table) {
+            e.check.store(0, std::memory_order_relaxed);
+            e.data.store(0, std::memory_order_relaxed);
+        }
+    }
+
+protected:
+    // data layout: value (32 bits float), depth (8 bits), best op (3 bits, 7 for none), bound type (2 bits),
+    // the move it was stored in (6 bits), and a nonzero tag that marks the entry as used
+    static uint64_t pack(float value, int depth, int best, int type) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return uint64_t(bits) | (uint64_t(depth & 0xff) << 32) | (uint64_t(best & 0x7) << 40)
+             | (uint64_t(type & 0x3) << 43) | (1ull << 63);
+    }
+    static result unpack(uint64_t data) {
+        uint32_t bits = uint32_t(data);
+        result res;
+        std::memcpy(&res.value, &bits, sizeof(bits));
+        res.depth = (data >> 32) & 0xff;
+        res.best = (data >> 40) & 0x7;
+        if (res.best > 3) res.best = -1;
+        res.type = (data >> 43) & 0x3;
+        return res;
+    }
+    static unsigned age_of(uint64_t data) { return (data >> 45) & 0x3f; }
+
+    struct entry {
+        std::atomic<uint64_t> check;
+        std::atomic<uint64_t> data;
+        entry() : check(0), data(0) {}
+    };
+
+private:
+    std::vector<entry> table;
+    size_t mask;
+    unsigned generation;
+};
@@ -1,38 +1,194 @@
-
 #pragma once
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
 
+/**
+ * weight table backed by its own memory mapping
+ *
+ * a new table is an anonymous zero mapping, so pages that are never written cost no resident memory
+ * a table can also be mapped privately from a saved weight file, pages are then read in on first use
+ */
 class weight {
 public:
-    weight() {}
-    weight(size_t len) : value(len) {}
-    weight(weight&& f) : value(std::move(f.value)) {}
-    weight(const weight& f) = default;
+    weight() : value(nullptr), length(0), shift(0), base(nullptr), mapped(0) {}
+    weight(size_t len) : weight() { allocate(len); }
+    weight(weight&& f) noexcept : weight() { swap(f); }
+    weight(const weight& f) : weight() {
+        allocate(f.length << f.shift);
+        std::memcpy(value, f.value, sizeof(float) * (f.length << f.shift));
+        length = f.length;
+        shift = f.shift;
+    }
+    ~weight() { release(); }
+
+    weight& operator =(weight f) { swap(f); return *this; }
+    float& operator[] (size_t i) { return value[i << shift]; }
+    const float& operator[] (size_t i) const { return value[i << shift]; }
+    size_t size() const { return length; }
+    void prefetch(size_t i) const { __builtin_prefetch(value + (i << shift)); }
 
-    weight& operator =(const weight& f) = default;
-    float& operator[] (size_t i) { return value[i]; }
-    const float& operator[] (size_t i) const { return value[i]; }
-    size_t size() const { return value.size(); }
+public:
+    /**
+     * map a table of len weights stored at the given byte offset of a weight file
+     * the mapping is private, so training writes never reach the file
+     */
+    bool map(int fd, size_t offset, size_t len) {
+        release();
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = offset - offset % page;
+        mapped = offset - start + sizeof(float) * len;
+        base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            mapped = 0;
+            return false;
+        }
+        value = reinterpret_cast<float*>(static_cast<char*>(base) + (offset - start));
+        length = len;
+        return true;
+    }
+
+    /**
+     * enable temporal coherence learning on this table
+     *
+     * each weight is followed by a pair of fp16 accumulators (E, A) in the next float slot,
+     * so the weight and its adaptive learning rate always share one cache line
+     */
+    void enable_coherence() {
+        if (shift) return;
+        weight inter;
+        inter.allocate(length * 2);
+        for (size_t i = 0; i < length; i++) {
+            if (value[i] != 0) inter.value[i * 2] = value[i]; // leave untouched pages untouched
+        }
+        inter.length = length;
+        inter.shift = 1;
+        swap(inter);
+    }
+    bool coherence() const { return shift; }
+
+    /**
+     * update the i-th weight with the TD error delta
+     * the step size is alpha, scaled by |E| / A if temporal coherence is enabled
+     */
+    void update(size_t i, float alpha, float delta) {
+        if (!shift) {
+            value[i] += alpha * delta;
+            return;
+        }
+        float& w = value[i << 1];
+        float& acc = value[(i << 1) + 1];
+        uint16_t ea[2];
+        std::memcpy(ea, &acc, sizeof(ea));
+        float e = half_to_float(ea[0]), a = half_to_float(ea[1]);
+        float beta = a > 0 ? std::min(std::fabs(e) / a, 1.0f) : 1.0f;
+        w += alpha * beta * delta;
+        e += delta;
+        a += std::fabs(delta);
+        // the rate is scale-free, halve both before fp16 loses the small updates
+        // (a huge delta needs several halvings, and anything still too large saturates in float_to_half)
+        while (a > 1024) {
+            e *= 0.5f;
+            a *= 0.5f;
+        }
+        ea[0] = float_to_half(e);
+        ea[1] = float_to_half(a);
+        std::memcpy(&acc, ea, sizeof(ea));
+    }
 
 public:
     friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-        auto& value = w.value;
-        uint64_t size = value.size();
+        uint64_t size = w.size();
         out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-        out.write(reinterpret_cast<const char*>(value.data()), sizeof(float) * size);
+        if (w.shift == 0) {
+            out.write(reinterpret_cast<const char*>(w.value), sizeof(float) * size);
+        } else {
+            // only the weights are saved, the accumulators restart from zero on load
+            std::vector<float> plain(size);
+            for (size_t i = 0; i < size; i++) plain[i] = w[i];
+            out.write(reinterpret_cast<const char*>(plain.data()), sizeof(float) * size);
+        }
         return out;
     }
     friend std::istream& operator >>(std::istream& in, weight& w) {
-        auto& value = w.value;
         uint64_t size = 0;
         in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-        value.resize(size);
-        in.read(reinterpret_cast<char*>(value.data()), sizeof(float) * size);
+        w.release();
+        w.allocate(size);
+        in.read(reinterpret_cast<char*>(w.value), sizeof(float) * size);
         return in;
     }
 
 protected:
-    std::vector<float> value;
+    void allocate(size_t len) {
+        release();
+        if (len == 0) return;
+        mapped = sizeof(float) * len;
+        base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) throw std::bad_alloc();
+        value = static_cast<float*>(base);
+        length = len;
+    }
+    void release() {
+        if (base) munmap(base, mapped);
+        value = nullptr;
+        length = 0;
+        shift = 0;
+        base = nullptr;
+        mapped = 0;
+    }
+    void swap(weight& f) {
+        std::swap(value, f.value);
+        std::swap(length, f.length);
+        std::swap(shift, f.shift);
+        std::swap(base, f.base);
+        std::swap(mapped, f.mapped);
+    }
+
+    static float half_to_float(uint16_t h) {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        float f;
+        if (exp == 0) {
+            f = std::ldexp(float(mant), -24);
+            return sign ? -f : f;
+        }
+        uint32_t bits = sign | (exp == 0x1f ? (0xffu << 23) : ((exp + 112) << 23)) | (mant << 13);
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    static uint16_t float_to_half(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        uint16_t sign = (bits >> 16) & 0x8000;
+        int exp = int((bits >> 23) & 0xff) - 127 + 15;
+        uint32_t mant = bits & 0x7fffff;
+        if (exp <= 0) {
+            if (exp < -10) return sign;
+            mant |= 0x800000;
+            int shift = 14 - exp;
+            uint16_t half = mant >> shift;
+            if ((mant >> (shift - 1)) & 1) half++;
+            return sign | half;
+        }
+        if (exp >= 0x1f) return sign | 0x7bff; // saturate at 65504 instead of inf
+        uint16_t half = sign | (exp << 10) | (mant >> 13);
+        if ((mant & 0x1000) && (half & 0x7fff) != 0x7bff) half++; // round to nearest, a carry moves into the exponent
+        return half;
+    }
+
+protected:
+    float* value;
+    size_t length;
+    unsigned shift;
+    void* base;
+    size_t mapped;
 };
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <algorithm>
+
+/**
+ * xoshiro256** pseudo-random generator (Blackman and Vigna), a drop-in UniformRandomBitGenerator
+ *
+ * the state is 4 words seeded through splitmix64, so any seed (even 0) gives a usable state
+ * below(n) and pick(mask) draw small ranges and set bits directly, without a distribution object
+ *
+ * jump() advances the state by 2^128 draws and long_jump() by 2^192, so one seed splits into
+ * non-overlapping streams: e.g., long_jump() once per game lane, then jump() once per stream of the lane
+ * a stream is saved and restored as its 4 state words in hex
+ */
+class xoshiro {
+public:
+    typedef uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+public:
+    xoshiro(uint64_t seed = 0) { this->seed(seed); }
+
+    void seed(uint64_t seed) {
+        for (uint64_t& s : state) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s = z ^ (z >> 31);
+        }
+    }
+
+    result_type operator()() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    /**
+     * return a uniform number in [0, n), by the multiply-shift of Lemire with rejection
+     */
+    uint32_t below(uint32_t n) {
+        uint64_t m = uint64_t(uint32_t(operator()() >> 32)) * n;
+        if (uint32_t(m) < n) {
+            uint32_t threshold = -n % n;
+            while (uint32_t(m) < threshold) m = uint64_t(uint32_t(operator()() >> 32)) * n;
+        }
+        return m >> 32;
+    }
+
+    /**
+     * return the index of a uniformly chosen set bit of a nonzero mask
+     */
+    int pick(uint32_t mask) {
+        for (uint32_t k = below(__builtin_popcount(mask)); k; k--) mask &= mask - 1;
+        return __builtin_ctz(mask);
+    }
+
+    void jump() { leap({ 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull }); }
+    void long_jump() { leap({ 0x76e15d3efefdcbbfull, 0xc5004e441c522fb3ull, 0x77710069854ee241ull, 0x39109bb02acbe635ull }); }
+
+public:
+    friend std::ostream& operator <<(std::ostream& out, const xoshiro& x) {
+        std::ios ff(nullptr);
+        ff.copyfmt(out);
+        out << std::hex;
+        for (int i = 0; i < 4; i++) out << (i ? " " : "") << x.state[i];
+        out.copyfmt(ff);
+        return out;
+    }
+    friend std::istream& operator >>(std::istream& in, xoshiro& x) {
+        uint64_t state[4];
+        for (uint64_t& s : state) in >> std::hex >> s;
+        if (in) std::copy(state, state + 4, x.state);
+        return in >> std::dec;
+    }
+
+private:
+    // the state after the number of draws given by the jump polynomial
+    void leap(const std::array<uint64_t, 4>& poly) {
+        uint64_t next[4] = {};
+        for (uint64_t word : poly) for (int b = 0; b < 64; b++) {
+            if (word & (1ull << b)) for (int i = 0; i < 4; i++) next[i] ^= state[i];
+            operator()();
+        }
+        std::copy(next, next + 4, state);
+    }
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+private:
+    uint64_t state[4];
+};